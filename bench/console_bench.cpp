@@ -0,0 +1,242 @@
+// console.cpp 的端到端 benchmark：不需要網路與真正的遠端 shell
+// 在本機啟動：
+//   1. fake shell server：送出 "% " prompt，每收到一行指令就等 delay、輸出固定大小的內容，再送下一個 prompt
+//   2. ./socks_server（暫存目錄裡放一份全部允許的 client_socks.conf）
+//   3. ./pj5.cgi，帶上產生好的 QUERY_STRING 與 ./test_case/<file>
+// 量測每個指令的 round trip（fake shell 送出 prompt → 收到下一行指令）、整體 replay 時間、
+// 第一段 shell 輸出出現在 stdout 的時間、console 寫到 stdout 的 bytes。
+// 由 1 台主機跑到 N 台主機；optimistic=1 時 QUERY_STRING 加上 so=1。
+//
+//   make consolebench
+//   ./bench/console_bench [max_hosts=5] [commands=20] [output_bytes=1024] [delay_ms=0] [optimistic=0]
+#include <utility>
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <climits>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using boost::asio::ip::tcp;
+using clk = std::chrono::steady_clock;
+
+struct options{
+    int         max_hosts    = 5;
+    int         commands     = 20;
+    std::size_t output_bytes = 1024;
+    int         delay_ms     = 0;
+    bool        optimistic   = false;
+};
+
+struct shell_stats{
+    std::mutex          mutex;
+    std::vector<double> rtt_us;           // prompt 送出 → 收到下一行指令
+};
+
+// 不含 "% " 的輸出內容，每行 79 個字元
+static std::string make_output(std::size_t bytes)
+{
+    std::string out;
+    out.reserve(bytes);
+    while (out.size() < bytes)
+        out.push_back((out.size() % 80 == 79) ? '\n' : char('a' + out.size() % 26));
+    return out;
+}
+
+static void fake_shell(tcp::socket s, const options& opt, shell_stats& stats)
+{
+    const std::string output = make_output(opt.output_bytes) + "% ";
+    boost::system::error_code ec;
+    boost::asio::write(s, boost::asio::buffer(std::string("** fake shell **\n% ")), ec);
+    auto prompt_at = clk::now();
+
+    boost::asio::streambuf buf;
+    std::vector<double> samples;
+    while (!ec) {
+        boost::asio::read_until(s, buf, '\n', ec);
+        if (ec)
+            break;
+        samples.push_back(std::chrono::duration<double, std::micro>(clk::now() - prompt_at).count());
+
+        std::istream is(&buf);
+        std::string line;
+        std::getline(is, line);
+        if (line == "exit")
+            break;
+
+        if (opt.delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(opt.delay_ms));
+        boost::asio::write(s, boost::asio::buffer(output), ec);
+        prompt_at = clk::now();
+    }
+
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    stats.rtt_us.insert(stats.rtt_us.end(), samples.begin(), samples.end());
+}
+
+static unsigned short free_port()
+{
+    boost::asio::io_context io;
+    tcp::acceptor a(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    return a.local_endpoint().port();
+}
+
+static bool wait_listening(unsigned short port)
+{
+    boost::asio::io_context io;
+    for (int i = 0; i < 200; ++i) {
+        tcp::socket s(io);
+        boost::system::error_code ec;
+        s.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port), ec);
+        if (!ec)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+static double percentile(std::vector<double> v, double p)
+{
+    if (v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, std::size_t(p * (v.size() - 1) + 0.5))];
+}
+
+int main(int argc, char* argv[])
+{
+    options opt;
+    if (argc > 1) opt.max_hosts    = std::clamp(std::atoi(argv[1]), 1, 5);   // console 最多五台
+    if (argc > 2) opt.commands     = std::atoi(argv[2]);
+    if (argc > 3) opt.output_bytes = std::strtoul(argv[3], nullptr, 10);
+    if (argc > 4) opt.delay_ms     = std::atoi(argv[4]);
+    if (argc > 5) opt.optimistic   = std::atoi(argv[5]) != 0;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        return 1;
+    const std::string socks_bin   = std::string(cwd) + "/socks_server";
+    const std::string console_bin = std::string(cwd) + "/pj5.cgi";
+
+    // 暫存目錄：client_socks.conf 與 test_case/
+    char dir_tmpl[] = "/tmp/console_bench.XXXXXX";
+    const std::string dir = mkdtemp(dir_tmpl);
+    std::ofstream(dir + "/client_socks.conf") << "permit c *.*.*.*\npermit c *\n";
+    mkdir((dir + "/test_case").c_str(), 0755);
+    {
+        std::ofstream tc(dir + "/test_case/bench.txt");
+        for (int i = 0; i < opt.commands; ++i)
+            tc << "cmd " << i << " <a href='x'>&\n";        // 順便走過 console 的 HTML escape
+        tc << "exit\n";
+    }
+
+    // SOCKS server
+    unsigned short socks_port = free_port();
+    pid_t socks_pid = fork();
+    if (socks_pid == 0) {
+        if (chdir(dir.c_str()) != 0)
+            _exit(1);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        execl(socks_bin.c_str(), socks_bin.c_str(), std::to_string(socks_port).c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    if (!wait_listening(socks_port)) {
+        std::fprintf(stderr, "socks_server did not start (%s)\n", socks_bin.c_str());
+        kill(socks_pid, SIGTERM);
+        return 1;
+    }
+
+    std::printf("commands/host=%d output=%zuB delay=%dms optimistic=%d\n",
+                opt.commands, opt.output_bytes, opt.delay_ms, int(opt.optimistic));
+    std::printf("%5s %10s %10s %12s %12s %12s %12s\n",
+                "hosts", "first ms", "replay ms", "rtt p50 us", "rtt p99 us", "rtt max us", "stdout B");
+
+    for (int hosts = 1; hosts <= opt.max_hosts; ++hosts) {
+        // fake shell server：接 hosts 條連線
+        boost::asio::io_context io;
+        tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        unsigned short shell_port = acceptor.local_endpoint().port();
+        shell_stats stats;
+        std::thread shell_server([&] {
+            std::vector<std::thread> shells;
+            for (int i = 0; i < hosts; ++i) {
+                boost::system::error_code ec;
+                tcp::socket s = acceptor.accept(ec);
+                if (ec)
+                    break;
+                shells.emplace_back(fake_shell, std::move(s), std::cref(opt), std::ref(stats));
+            }
+            for (auto& t : shells)
+                t.join();
+        });
+
+        std::string query;
+        for (int i = 0; i < hosts; ++i)
+            query += "h" + std::to_string(i) + "=127.0.0.1&p" + std::to_string(i) + "=" +
+                     std::to_string(shell_port) + "&f" + std::to_string(i) + "=bench.txt&";
+        query += "sh=127.0.0.1&sp=" + std::to_string(socks_port);
+        if (opt.optimistic)
+            query += "&so=1";
+
+        int out_pipe[2];
+        if (pipe(out_pipe) != 0)
+            return 1;
+        auto t0 = clk::now();
+        pid_t console_pid = fork();
+        if (console_pid == 0) {
+            if (chdir(dir.c_str()) != 0)
+                _exit(1);
+            dup2(out_pipe[1], STDOUT_FILENO);
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+            setenv("QUERY_STRING", query.c_str(), 1);
+            execl(console_bin.c_str(), console_bin.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        close(out_pipe[1]);
+
+        // 第一個 <script> 就是第一段 shell 輸出（HTML 骨架裡沒有 <script>）
+        static const std::string kScript = "<script>";
+        std::size_t stdout_bytes = 0;
+        double first_ms = 0;
+        std::string tail;
+        char buf[65536];
+        for (ssize_t n; (n = read(out_pipe[0], buf, sizeof(buf))) > 0; ) {
+            stdout_bytes += n;
+            if (first_ms == 0) {
+                tail.append(buf, n);
+                if (tail.find(kScript) != std::string::npos)
+                    first_ms = std::chrono::duration<double, std::milli>(clk::now() - t0).count();
+                else
+                    tail.erase(0, tail.size() > kScript.size() ? tail.size() - kScript.size() : 0);
+            }
+        }
+        close(out_pipe[0]);
+        waitpid(console_pid, nullptr, 0);
+        double replay_ms = std::chrono::duration<double, std::milli>(clk::now() - t0).count();
+
+        acceptor.close();
+        shell_server.join();
+
+        std::printf("%5d %10.2f %10.1f %12.1f %12.1f %12.1f %12zu\n", hosts, first_ms, replay_ms,
+                    percentile(stats.rtt_us, 0.5), percentile(stats.rtt_us, 0.99),
+                    percentile(stats.rtt_us, 1.0), stdout_bytes);
+    }
+
+    kill(socks_pid, SIGTERM);
+    waitpid(socks_pid, nullptr, 0);
+    std::system(("rm -rf " + dir).c_str());
+    return 0;
+}
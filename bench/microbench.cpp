@@ -0,0 +1,123 @@
+// 握手路徑的 microbenchmark：ns/op 與 allocations/op
+// make microbench 會編譯並執行
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+#include "../socks4.hpp"
+
+// 全域 operator new 計數，用來算每次操作配置幾次記憶體
+static std::size_t g_allocs = 0;
+
+void* operator new(std::size_t n)
+{
+    ++g_allocs;
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+template<class T>
+static void keep(T&& v)
+{
+    asm volatile("" : : "g"(&v) : "memory");
+}
+
+template<class Fn>
+static void run(const char* name, std::size_t iters, Fn&& fn)
+{
+    for (std::size_t i = 0; i < iters / 10; ++i)     // warm up
+        fn(i);
+
+    std::size_t allocs0 = g_allocs;
+    auto t0 = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < iters; ++i)
+        fn(i);
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("%-28s %10.1f ns/op %8.2f allocs/op\n",
+                name, ns / iters, double(g_allocs - allocs0) / iters);
+}
+
+static std::vector<uint8_t> socks4_request(uint8_t cd, uint16_t port, std::array<uint8_t, 4> ip,
+                                           const std::string& domain = "")
+{
+    std::vector<uint8_t> pkt{4, cd, uint8_t(port >> 8), uint8_t(port & 0xFF), ip[0], ip[1], ip[2], ip[3]};
+    pkt.push_back(0);                                  // USERID terminator
+    if (!domain.empty()) {
+        pkt.insert(pkt.end(), domain.begin(), domain.end());
+        pkt.push_back(0);
+    }
+    return pkt;
+}
+
+int main()
+{
+    const std::size_t kIters = 1000000;
+
+    auto v4  = socks4_request(1, 80, {140, 113, 1, 2});
+    auto v4a = socks4_request(1, 443, {0, 0, 0, 1}, "WWW.Example.COM");
+
+    socks4Msg msg;
+    run("parse socks4", kIters, [&](std::size_t) {
+        parse_socks4_request(v4.data(), v4.size(), msg);
+        keep(msg);
+    });
+    run("parse socks4a", kIters, [&](std::size_t) {
+        parse_socks4_request(v4a.data(), v4a.size(), msg);
+        keep(msg);
+    });
+
+    const std::string hit_pattern = "140.113.*.*", miss_pattern = "140.114.*.*", ip = "140.113.1.2";
+    run("match_ip hit", kIters, [&](std::size_t) {
+        bool r = match_ip(hit_pattern, ip);
+        keep(r);
+    });
+    run("match_ip miss", kIters, [&](std::size_t) {
+        bool r = match_ip(miss_pattern, ip);
+        keep(r);
+    });
+
+    run("split_tokens", kIters / 10, [&](std::size_t) {
+        auto t = split_tokens("permit c 140.113.*.*\r", ' ');
+        keep(t);
+    });
+
+    // 典型的 client_socks.conf：幾條 IP 規則 + 幾條 domain 規則，要比對的放在最後
+    const char* kConf = "/tmp/microbench_socks.conf";
+    {
+        FILE* f = std::fopen(kConf, "w");
+        for (int i = 0; i < 8; ++i)
+            std::fprintf(f, "permit c 10.%d.*.*\n", i);
+        std::fprintf(f, "permit b *.*.*.*\n");
+        std::fprintf(f, "deny c ads.example.com\npermit c *.example.com\npermit c *.nycu.edu.tw\n");
+        std::fprintf(f, "permit c 140.113.*.*\n");
+        std::fclose(f);
+    }
+    firewall_rules rules;
+    rules.load(kConf);
+    std::remove(kConf);
+
+    socks4Msg req_ip, req_domain, req_unknown;
+    parse_socks4_request(v4.data(), v4.size(), req_ip);
+    parse_socks4_request(v4a.data(), v4a.size(), req_domain);
+    auto v4a_unknown = socks4_request(1, 443, {0, 0, 0, 1}, "www.unknown.org");
+    parse_socks4_request(v4a_unknown.data(), v4a_unknown.size(), req_unknown);
+
+    run("firewall ip rules", kIters, [&](std::size_t) {
+        auto d = evaluate_firewall(rules, req_ip);
+        keep(d);
+    });
+    run("firewall domain rules", kIters, [&](std::size_t) {
+        auto d = evaluate_firewall(rules, req_domain);
+        keep(d);
+    });
+    run("firewall domain miss", kIters, [&](std::size_t) {
+        auto d = evaluate_firewall(rules, req_unknown);
+        keep(d);
+    });
+    return 0;
+}
@@ -0,0 +1,418 @@
+// relay 路徑的 small-packet benchmark，三種結構：
+//   callback  callback chain（user-030 之前的 session）
+//   pump      一條 coroutine 讀寫同一個 buffer（user-030 的 session::pump()，作為對照）
+//   queue     每個方向 reader / writer 兩條 coroutine 加上有水位與預算的 chunk 佇列（目前的 session::relay()）
+// 每一輪是 client → relay → echo → relay → client 的 ping-pong，所以每個封包都是一次獨立的 read / write。
+// 只統計 relay 執行緒的 operator new 次數與 CPU 時間（RUSAGE_THREAD）。
+// make relaybench 會編譯並執行
+#include <utility>
+#include <boost/asio.hpp>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <new>
+#include <thread>
+#include <sys/resource.h>
+
+using boost::asio::ip::tcp;
+using boost::asio::awaitable;
+using boost::asio::redirect_error;
+using boost::asio::use_awaitable;
+
+static constexpr std::size_t kBufSize = 10240;
+static constexpr std::size_t kRelayChunk = 16384;
+static constexpr std::size_t kHighWatermark = 256 * 1024;
+static constexpr std::size_t kLowWatermark  = 64 * 1024;
+
+static thread_local bool        t_counting = false;
+static thread_local std::size_t t_allocs   = 0;
+
+void* operator new(std::size_t n)
+{
+    if (t_counting)
+        ++t_allocs;
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static double thread_cpu_us()
+{
+    rusage ru{};
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+}
+
+/* ---------- 舊版：每個 async 操作都複製 shared_from_this() ---------- */
+class callback_relay : public std::enable_shared_from_this<callback_relay>{
+  public:
+    callback_relay(tcp::socket client, tcp::socket remote)
+     : client_socket_(std::move(client)), remote_socket_(std::move(remote)) {}
+
+    void start() { read_from_client(); read_from_remote(); }
+
+  private:
+    void close_session()
+    {
+        boost::system::error_code _;
+        client_socket_.close(_);
+        remote_socket_.close(_);
+    }
+
+    void read_from_client()
+    {
+        auto self = shared_from_this();
+        client_socket_.async_read_some(boost::asio::buffer(up_buf_),
+            [self](auto ec, std::size_t n) {
+                if (ec) { self->close_session(); return; }
+                self->write_to_remote(n);
+            });
+    }
+
+    void write_to_remote(std::size_t n)
+    {
+        auto self = shared_from_this();
+        boost::asio::async_write(remote_socket_, boost::asio::buffer(up_buf_, n),
+            [self](auto ec, std::size_t) {
+                if (ec) { self->close_session(); return; }
+                self->read_from_client();
+            });
+    }
+
+    void read_from_remote()
+    {
+        auto self = shared_from_this();
+        remote_socket_.async_read_some(boost::asio::buffer(down_buf_),
+            [self](auto ec, std::size_t n) {
+                if (ec) { self->close_session(); return; }
+                self->write_to_client(n);
+            });
+    }
+
+    void write_to_client(std::size_t n)
+    {
+        auto self = shared_from_this();
+        boost::asio::async_write(client_socket_, boost::asio::buffer(down_buf_, n),
+            [self](auto ec, std::size_t) {
+                if (ec) { self->close_session(); return; }
+                self->read_from_remote();
+            });
+    }
+
+    tcp::socket client_socket_;
+    tcp::socket remote_socket_;
+    std::array<uint8_t, kBufSize> up_buf_;
+    std::array<uint8_t, kBufSize> down_buf_;
+};
+
+/* ---------- user-030：session::relay() / pump() 的結構（單一 buffer，對照組） ---------- */
+class coroutine_relay{
+  public:
+    coroutine_relay(tcp::socket client, tcp::socket remote)
+     : client_socket_(std::move(client)), remote_socket_(std::move(remote)),
+       down_done_timer_(client_socket_.get_executor()) {}
+
+    static awaitable<void> serve(std::unique_ptr<coroutine_relay> self)
+    {
+        co_await self->relay();
+    }
+
+  private:
+    void close_session()
+    {
+        boost::system::error_code _;
+        client_socket_.close(_);
+        remote_socket_.close(_);
+    }
+
+    awaitable<void> relay()
+    {
+        down_done_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+        boost::asio::co_spawn(client_socket_.get_executor(),
+            pump(remote_socket_, client_socket_, down_buf_),
+            [this](std::exception_ptr) {
+                down_done_ = true;
+                down_done_timer_.cancel();
+            });
+
+        co_await pump(client_socket_, remote_socket_, up_buf_);
+
+        if (!down_done_) {
+            boost::system::error_code ec;
+            co_await down_done_timer_.async_wait(redirect_error(use_awaitable, ec));
+        }
+    }
+
+    awaitable<void> pump(tcp::socket& from, tcp::socket& to, std::array<uint8_t, kBufSize>& buf)
+    {
+        boost::system::error_code ec;
+        for (;;) {
+            std::size_t n = co_await from.async_read_some(
+                boost::asio::buffer(buf), redirect_error(use_awaitable, ec));
+            if (ec)
+                break;
+            co_await boost::asio::async_write(
+                to, boost::asio::buffer(buf, n), redirect_error(use_awaitable, ec));
+            if (ec)
+                break;
+        }
+        close_session();
+    }
+
+    tcp::socket client_socket_;
+    tcp::socket remote_socket_;
+    std::array<uint8_t, kBufSize> up_buf_;
+    std::array<uint8_t, kBufSize> down_buf_;
+    boost::asio::steady_timer down_done_timer_;
+    bool down_done_ = false;
+};
+
+/* ---------- 目前：session::relay() 的 reader / writer 與 relay_queue ---------- */
+// 與 socks_server.cpp 相同的流程：wait_read → 向預算預留 chunk → non-blocking read_some → writer 寫出並在佇列寫空時還回
+class queue_relay{
+  public:
+    queue_relay(boost::asio::io_context& io_context, tcp::socket client, tcp::socket remote)
+     : io_context_(io_context), client_socket_(std::move(client)), remote_socket_(std::move(remote)),
+       up_(io_context), down_(io_context), pumps_done_timer_(io_context) {}
+
+    static awaitable<void> serve(std::unique_ptr<queue_relay> self)
+    {
+        co_await self->relay();
+    }
+
+  private:
+    struct relay_queue{
+        struct chunk{
+            std::unique_ptr<uint8_t[]> data{new uint8_t[kRelayChunk]};
+            std::size_t off = 0;
+            std::size_t len = 0;
+        };
+        explicit relay_queue(boost::asio::io_context& io) : reader_wake(io), writer_wake(io) {}
+
+        std::deque<chunk> chunks;
+        bool idle_tail = false;
+        std::size_t queued = 0;
+        bool reader_done = false;
+        boost::asio::steady_timer reader_wake;
+        boost::asio::steady_timer writer_wake;
+    };
+
+    void close_session()
+    {
+        closed_ = true;
+        boost::system::error_code _;
+        client_socket_.close(_);
+        remote_socket_.close(_);
+        for (auto* q : {&up_, &down_}) {
+            q->reader_wake.cancel();
+            q->writer_wake.cancel();
+        }
+    }
+
+    static awaitable<void> wait_on(boost::asio::steady_timer& timer)
+    {
+        static boost::system::error_code ignored;
+        timer.expires_at(std::chrono::steady_clock::time_point::max());
+        return timer.async_wait(redirect_error(use_awaitable, ignored));
+    }
+
+    awaitable<void> relay()
+    {
+        auto spawn = [this](awaitable<void> pump) {
+            ++active_pumps_;
+            boost::asio::co_spawn(io_context_, std::move(pump),
+                [this](std::exception_ptr) {
+                    --active_pumps_;
+                    pumps_done_timer_.cancel();
+                });
+        };
+        boost::system::error_code ec;
+        client_socket_.non_blocking(true, ec);
+        remote_socket_.non_blocking(true, ec);
+        spawn(relay_read(client_socket_, up_));
+        spawn(relay_write(remote_socket_, up_));
+        spawn(relay_read(remote_socket_, down_));
+        spawn(relay_write(client_socket_, down_));
+        while (active_pumps_ > 0)
+            co_await wait_on(pumps_done_timer_);
+    }
+
+    awaitable<void> relay_read(tcp::socket& from, relay_queue& q)
+    {
+        boost::system::error_code ec;
+        while (!closed_) {
+            if (q.queued >= kHighWatermark) {
+                while (!closed_ && q.queued > kLowWatermark)
+                    co_await wait_on(q.reader_wake);
+                continue;
+            }
+            co_await from.async_wait(tcp::socket::wait_read, redirect_error(use_awaitable, ec));
+            if (ec || closed_)
+                break;
+            if (q.chunks.empty() || q.idle_tail || q.chunks.back().len == kRelayChunk) {
+                budget_used_.fetch_add(kRelayChunk, std::memory_order_relaxed);
+                if (q.idle_tail)
+                    q.idle_tail = false;
+                else
+                    q.chunks.emplace_back();
+            }
+            auto& tail = q.chunks.back();
+            std::size_t n = from.read_some(
+                boost::asio::buffer(tail.data.get() + tail.len, kRelayChunk - tail.len), ec);
+            if (ec == boost::asio::error::would_block) {
+                if (tail.len == 0) {
+                    if (q.chunks.size() == 1)
+                        q.idle_tail = true;
+                    else
+                        q.chunks.pop_back();
+                    budget_used_.fetch_sub(kRelayChunk, std::memory_order_relaxed);
+                }
+                ec = {};
+                continue;
+            }
+            if (ec)
+                break;
+            tail.len += n;
+            q.queued += n;
+            q.writer_wake.cancel();
+        }
+        q.reader_done = true;
+        q.writer_wake.cancel();
+    }
+
+    awaitable<void> relay_write(tcp::socket& to, relay_queue& q)
+    {
+        boost::system::error_code ec;
+        for (;;) {
+            while (!closed_ && q.queued == 0 && !q.reader_done)
+                co_await wait_on(q.writer_wake);
+            if (closed_ || q.queued == 0)
+                break;
+            while (q.chunks.front().off == q.chunks.front().len && q.chunks.size() > 1) {
+                q.chunks.pop_front();
+                budget_used_.fetch_sub(kRelayChunk, std::memory_order_relaxed);
+            }
+            auto& front = q.chunks.front();
+            std::size_t n = co_await boost::asio::async_write(
+                to, boost::asio::buffer(front.data.get() + front.off, front.len - front.off),
+                redirect_error(use_awaitable, ec));
+            if (ec)
+                break;
+            front.off += n;
+            q.queued  -= n;
+            if (front.off == front.len && q.chunks.size() > 1) {
+                q.chunks.pop_front();
+                budget_used_.fetch_sub(kRelayChunk, std::memory_order_relaxed);
+            }
+            else if (q.queued == 0) {
+                front.off = front.len = 0;
+                q.idle_tail = true;
+                budget_used_.fetch_sub(kRelayChunk, std::memory_order_relaxed);
+            }
+            if (q.queued <= kLowWatermark)
+                q.reader_wake.cancel();
+        }
+        close_session();
+    }
+
+    boost::asio::io_context& io_context_;
+    tcp::socket client_socket_;
+    tcp::socket remote_socket_;
+    relay_queue up_;
+    relay_queue down_;
+    boost::asio::steady_timer pumps_done_timer_;
+    int active_pumps_ = 0;
+    bool closed_ = false;
+    std::atomic<uint64_t> budget_used_{0};           // 代替共享記憶體裡的 relay_budget
+};
+
+template<class Start>
+static void run(const char* name, std::size_t packets, std::size_t packet_size, Start&& start)
+{
+    boost::asio::io_context io_context;
+    tcp::acceptor front(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::acceptor back(io_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+
+    // echo server（遠端）
+    std::thread remote([&back] {
+        boost::system::error_code ec;
+        tcp::socket s = back.accept(ec);
+        s.set_option(tcp::no_delay(true));
+        std::array<uint8_t, kBufSize> buf;
+        for (;;) {
+            std::size_t n = s.read_some(boost::asio::buffer(buf), ec);
+            if (ec)
+                break;
+            boost::asio::write(s, boost::asio::buffer(buf, n), ec);
+            if (ec)
+                break;
+        }
+    });
+
+    // client：同步 ping-pong
+    double client_us = 0;
+    std::thread client([&, port = front.local_endpoint().port()] {
+        boost::asio::io_context io;
+        tcp::socket s(io);
+        s.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port));
+        s.set_option(tcp::no_delay(true));
+        std::vector<uint8_t> out(packet_size, 'x'), in(packet_size);
+        auto t0 = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < packets; ++i) {
+            boost::asio::write(s, boost::asio::buffer(out));
+            boost::asio::read(s, boost::asio::buffer(in));
+        }
+        client_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+        s.close();
+    });
+
+    tcp::socket client_side = front.accept();
+    tcp::socket remote_side(io_context);
+    remote_side.connect(back.local_endpoint());
+    client_side.set_option(tcp::no_delay(true));
+    remote_side.set_option(tcp::no_delay(true));
+
+    start(io_context, std::move(client_side), std::move(remote_side));
+
+    t_allocs   = 0;
+    t_counting = true;
+    double cpu0 = thread_cpu_us();
+    io_context.run();
+    double cpu = thread_cpu_us() - cpu0;
+    t_counting = false;
+
+    client.join();
+    remote.join();
+
+    // 每個 ping-pong 封包在 relay 上是 2 次 read + 2 次 write
+    std::printf("%-10s packets=%zu size=%zu  %6.2f allocs/packet  %6.2f us relay CPU/packet  %6.2f us RTT\n",
+                name, packets, packet_size, double(t_allocs) / packets, cpu / packets, client_us / packets);
+}
+
+int main(int argc, char* argv[])
+{
+    std::size_t packets = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000;
+    std::size_t size    = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+
+    for (int round = 0; round < 2; ++round) {
+        run("callback", packets, size, [](boost::asio::io_context&, tcp::socket c, tcp::socket r) {
+            std::make_shared<callback_relay>(std::move(c), std::move(r))->start();
+        });
+        run("pump", packets, size, [](boost::asio::io_context& io, tcp::socket c, tcp::socket r) {
+            boost::asio::co_spawn(io,
+                coroutine_relay::serve(std::make_unique<coroutine_relay>(std::move(c), std::move(r))),
+                boost::asio::detached);
+        });
+        run("queue", packets, size, [](boost::asio::io_context& io, tcp::socket c, tcp::socket r) {
+            boost::asio::co_spawn(io,
+                queue_relay::serve(std::make_unique<queue_relay>(io, std::move(c), std::move(r))),
+                boost::asio::detached);
+        });
+    }
+    return 0;
+}
@@ -9,17 +9,21 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <netinet/tcp.h>
 
 using boost::asio::ip::tcp;
 using namespace std;
 
 std::array<std::string, 5> host, port, file;
 std::string socks_host, socks_port;
+bool socks_optimistic = false;  // so=1：SOCKS reply 與 shell 輸出當成同一條 stream 讀
 
 /* ---------------Parse Query String----------------- */
 /* 
 ** /console.cgi?h0=nplinux1&p0=12345&f0=t1.txt&h1=nplinux2&p1=22222&f1=t2.txt&sh=127.0.0.1&sp=1080
 ** 解析出"?"後面的 query string，就可以知道要連到哪些 host / port
+** 另外可加 so=1（opt-in）：送出 SOCKS request 後不等 reply 就開始讀，reply 從 stream 開頭取出
 */
 void parse_query_string()
 {
@@ -34,7 +38,7 @@ void parse_query_string()
   // 由於query string有固定格式，這邊以regular expression來解析
   // key=value pair之間以 & 分隔
   std::regex kv(R"(([hpf])(\d)=([^&]*))");  // h0 / p3 / f2
-  std::regex sx(R"(s([hp])=([^&]*))");  // sh / sp(SOCKS host / port)
+  std::regex sx(R"(s([hpo])=([^&]*))");  // sh / sp / so(SOCKS host / port / optimistic)
   std::smatch match;  // 針對 std::string 做正則搜尋時存放「比對結果」的容器
   auto iterator = query_string.cbegin();
 
@@ -68,8 +72,11 @@ void parse_query_string()
       if (match[1] == "h")
           socks_host = match[2];
       // s'p'
-      else
+      else if (match[1] == "p")
           socks_port = match[2];
+      // s'o'
+      else
+          socks_optimistic = (match[2] == "1");
           
       iterator = match.suffix().first;
   }
@@ -121,13 +128,61 @@ void replace_newLine(std::string& str)
   }
 }
 
+/* ---------------SOCKS Proxy 位址快取----------------- */
+/*
+** 每台主機都經過同一個 SOCKS Proxy，所以只解析一次：
+** 第一個 Client 觸發 async_resolve，解析期間其他 Client 排進 waiters_，完成後一起通知；
+** 之後的 Client 直接拿快取的結果，不再各自 resolve。
+*/
+class ProxyEndpoints
+{
+public:
+  using Handler = std::function<void(boost::system::error_code, const std::vector<tcp::endpoint>&)>;
+
+  explicit ProxyEndpoints(boost::asio::io_context& io_context)
+    : resolver_(io_context)
+  {
+  }
+
+  void get(Handler handler)
+  {
+    if (resolved_)
+    {
+      boost::asio::post(resolver_.get_executor(),
+          [this, handler]() { handler(ec_, endpoints_); });
+      return;
+    }
+
+    waiters_.push_back(std::move(handler));
+    if (waiters_.size() > 1)  // 已經在解析中
+      return;
+
+    resolver_.async_resolve(socks_host, socks_port,
+        [this](boost::system::error_code ec, tcp::resolver::results_type results) {
+            resolved_ = true;
+            ec_ = ec;
+            for (const auto& r : results)
+              endpoints_.push_back(r.endpoint());
+            for (auto& waiter : std::exchange(waiters_, {}))
+              waiter(ec_, endpoints_);
+        });
+  }
+
+private:
+  tcp::resolver resolver_;
+  bool resolved_ = false;
+  boost::system::error_code ec_;
+  std::vector<tcp::endpoint> endpoints_;
+  std::vector<Handler> waiters_;
+};
+
 class Client
   : public std::enable_shared_from_this<Client>
 {
 public:
   // Constructor
-  Client(boost::asio::io_context& io_context, int id)
-    : resolver_(io_context), socket_(io_context), id_(id), first_prompt_(true)
+  Client(boost::asio::io_context& io_context, int id, ProxyEndpoints& proxy)
+    : socket_(io_context), proxy_(proxy), id_(id), first_prompt_(true)
   {
   }
 
@@ -139,20 +194,57 @@ public:
     fin_.open("./test_case/" + file[id_]);
 
     auto self = shared_from_this();
-    // 非同步解析 SOCKS 伺服器的 IP / Port
-    resolver_.async_resolve(socks_host, socks_port,
-        [this, self](boost::system::error_code ec, tcp::resolver::results_type eps) {
-            if (!ec) {
-                boost::asio::async_connect(socket_, eps,
-                    [this, self](boost::system::error_code ec, auto) {
-                        if (!ec)
-                            send_socks_request();
-                    });
-            }
+    // SOCKS 伺服器的 IP / Port（所有 Client 共用一次解析）
+    proxy_.get(
+        [this, self](boost::system::error_code ec, const std::vector<tcp::endpoint>& eps) {
+            if (!ec)
+                connect_proxy(eps, 0);
         });
   }
 
 private:
+  /*
+  ** 依序嘗試 proxy 的每個位址。connect 之前打開 TCP_FASTOPEN_CONNECT：
+  ** kernel 已經有這個 proxy 的 TFO cookie 時，connect 立刻完成，SOCKS request 跟著 SYN 一起送出，
+  ** 省下一個 round trip；沒有 cookie 或 proxy 不支援時就是一般的 three-way handshake。
+  ** TFO 下 connect 不等 SYN-ACK 就完成，proxy 沒開的錯誤要到送 request / 讀 reply 才出現，見 retry_proxy()。
+  */
+  void connect_proxy(const std::vector<tcp::endpoint>& eps, std::size_t index)
+  {
+    proxy_eps_   = &eps;
+    proxy_index_ = index;
+    if (index >= eps.size())
+      return;
+
+    boost::system::error_code ec;
+    socket_.close(ec);
+    socket_.open(eps[index].protocol(), ec);
+    if (ec)
+      return;
+#ifdef TCP_FASTOPEN_CONNECT
+    using fastopen_connect = boost::asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_FASTOPEN_CONNECT>;
+    socket_.set_option(fastopen_connect(true), ec);  // 不支援就忽略
+#endif
+
+    auto self = shared_from_this();
+    socket_.async_connect(eps[index],
+        [this, self, &eps, index](boost::system::error_code ec) {
+            if (ec)
+                connect_proxy(eps, index + 1);
+            else
+                send_socks_request();
+        });
+  }
+
+  // 還沒收到 SOCKS reply 就出錯：換 proxy 的下一個位址重新來過
+  // attempt 是發出該操作時的 proxy_index_；so=1 時 write 與 read 會一起失敗，只換一次。
+  // operation_aborted 是自己 close() 造成的（收到 91 或已經換位址），不算 proxy 的錯誤
+  void retry_proxy(const boost::system::error_code& ec, std::size_t attempt)
+  {
+    if (ec != boost::asio::error::operation_aborted && attempt == proxy_index_)
+      connect_proxy(*proxy_eps_, proxy_index_ + 1);
+  }
+
   // do_read()
   // 持續收 Shell 輸出 -> output_shell() 寫入網頁。
   // 遇到 % Prompt 才代表 Shell 就緒，再送下一行指令。
@@ -160,11 +252,37 @@ private:
   {
     auto self(shared_from_this());
     socket_.async_read_some(boost::asio::buffer(data_, max_length),
-        [this, self](boost::system::error_code ec, std::size_t length)
+        [this, self, attempt = proxy_index_](boost::system::error_code ec, std::size_t length)
         {
+          if (ec && reply_pending_)
+            retry_proxy(ec, attempt);
           if (!ec)
           {
-            std::string str(self->data_, length);
+            std::size_t skip = 0;
+            if (reply_pending_)  // so=1：stream 開頭的 8 bytes 是 SOCKS reply
+            {
+              skip = std::min(length, reply_buf_.size() - reply_got_);
+              std::copy_n(data_, skip, reply_buf_.begin() + reply_got_);
+              reply_got_ += skip;
+              if (reply_got_ < reply_buf_.size())
+              {
+                do_read();
+                return;
+              }
+              reply_pending_ = false;
+              if (reply_buf_[1] != 0x5A)  // 91 = request rejected or failed
+              {
+                socket_.close();
+                return;
+              }
+              if (skip == length)
+              {
+                do_read();
+                return;
+              }
+            }
+
+            std::string str(self->data_ + skip, length - skip);
             self->output_shell(str);
             if (str.find("% ") != std::string::npos)
             {
@@ -185,12 +303,14 @@ private:
   }
 
   // 組成 SOCK4A CONNECT Request，非同步送給 SOCKS Proxy
+  // 一般模式寫完後等 8 bytes 的 reply 再開始 do_read()；so=1 時寫出去的同時就開始讀
   void send_socks_request()
   {
-      std::vector<uint8_t> pkt;
+      std::vector<uint8_t>& pkt = socks_request_;  // 成員：async_write 期間 buffer 必須存在
 
       if (port[id_].empty()) return;
 
+      pkt.clear();                             // 換下一個 proxy 位址重送時重新組
       pkt.reserve(9 + host[id_].size());
   
       pkt.push_back(0x04);                     // VN = 4, SOCKS protocol version number.
@@ -216,9 +336,17 @@ private:
   
       auto self = shared_from_this();
       boost::asio::async_write(socket_, boost::asio::buffer(pkt),
-          [this, self](auto ec, auto){
-              if (!ec) recv_socks_reply();
+          [this, self, attempt = proxy_index_](auto ec, auto){
+              if (ec) retry_proxy(ec, attempt);
+              else if (!socks_optimistic) recv_socks_reply();
           });
+
+      if (socks_optimistic)
+      {
+          reply_pending_ = true;
+          reply_got_ = 0;
+          do_read();
+      }
   }
   
   // 收 SOCKS Proxy 回覆，確認是否成功
@@ -228,8 +356,11 @@ private:
   {
       auto self = shared_from_this();
       boost::asio::async_read(socket_, boost::asio::buffer(reply_buf_),   // 8 bytes
-          [this, self](auto ec, auto){
-              if (!ec && reply_buf_[1] == 0x5A) {     // 90 = request granted
+          [this, self, attempt = proxy_index_](auto ec, auto){
+              if (ec) {                              // proxy 沒回 reply 就斷了（TFO 下包含連不上）
+                  retry_proxy(ec, attempt);
+              }
+              else if (reply_buf_[1] == 0x5A) {      // 90 = request granted
                   do_read();
               }
               else {
@@ -288,8 +419,13 @@ private:
   }
 
   std::array<uint8_t, 8> reply_buf_;
-  tcp::resolver resolver_;
+  std::size_t reply_got_ = 0;
+  bool reply_pending_ = false;
+  std::vector<uint8_t> socks_request_;
+  const std::vector<tcp::endpoint>* proxy_eps_ = nullptr;   // ProxyEndpoints 的快取，程式結束前都有效
+  std::size_t proxy_index_ = 0;                            // 目前嘗試的 proxy 位址
   tcp::socket   socket_;
+  ProxyEndpoints& proxy_;
   std::ifstream fin_;
   int id_;
   enum { max_length = 1024 };
@@ -377,12 +513,13 @@ int main(int argc, char* argv[])
     print_html();  // 輸出 HTML 頁面
 
     boost::asio::io_context io_context;
+    ProxyEndpoints proxy(io_context);
 
     std::vector<std::shared_ptr<Client>> clients;
     for (int i = 0; i < 5; ++i) {
         if (host[i].empty())
           continue;
-        auto c = std::make_shared<Client>(io_context, i);
+        auto c = std::make_shared<Client>(io_context, i, proxy);
         clients.push_back(c);
         c->start();
     }
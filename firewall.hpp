@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+** client_socks.conf 的防火牆規則
+** 每行格式：<verb> <type> <pattern>
+**   permit c 140.113.*.*        IP 規則（四段，每段是數字或 *），只認 permit
+**   permit c *.example.com      domain 規則，* 開頭代表「任何子網域」（不含 example.com 本身）
+**   deny   c ads.example.com    domain 規則也可以 deny，精確比對
+**   permit b *                  單獨一個 * 代表所有 domain
+** domain 規則在 DNS 解析之前就對 SOCKS4a 的原始 domain 比對，最長（最精確）的 suffix 決定結果；
+** 都沒有符合時才解析 domain，再用 IP 規則檢查解析出的位址。預設拒絕。
+*/
+
+// 判斷 IP 是否符合 pattern, e.g., pattern = "140.113.*.*", ip = "140.113.5.6"
+inline bool match_ip(const std::string& pattern, const std::string& ip)
+{
+    std::array<std::string, 4> p{}, a{};
+    std::istringstream(pattern) >> p[0];             // 先把整個 pattern 讀進 p[0]
+    // Tips: >> 對 std::string 是以空白當分隔，所以先把 . 換成空白，>> 就能一次讀四段。
+    std::replace(p[0].begin(), p[0].end(), '.', ' ');
+    std::istringstream(p[0]) >> p[0] >> p[1] >> p[2] >> p[3];
+
+    std::istringstream(ip) >> a[0];
+    std::replace(a[0].begin(), a[0].end(), '.', ' ');
+    std::istringstream(a[0]) >> a[0] >> a[1] >> a[2] >> a[3];
+
+    for (size_t i = 0; i < 4; ++i)
+        if (p[i] != "*" && p[i] != a[i])
+            return false;
+    return true;
+}
+
+enum class fw_verdict : int8_t { none = -1, deny = 0, permit = 1 };
+
+/*
+** domain 規則編譯成「反轉 label 的 suffix trie」：
+** www.example.com → com → example → www，從最右邊的 label 往下走。
+** 每個 node 記兩種結果（分 c / b）：exact（整個 domain 剛好走完）與 wildcard（後面至少還有一個 label）。
+** 編譯完攤平成連續陣列，兄弟節點依 label 排序，查詢時用 binary search，不做任何配置。
+*/
+class domain_rules{
+  public:
+    // pattern 須為小寫；cd: 1 = CONNECT, 2 = BIND
+    void add(std::string_view pattern, int cd, fw_verdict v)
+    {
+        if (cd != 1 && cd != 2)
+            return;
+        if (build_.empty())
+            build_.emplace_back();
+
+        bool wildcard = false;
+        if (pattern == "*")
+            pattern = std::string_view{}, wildcard = true;
+        else if (pattern.size() > 2 && pattern.substr(0, 2) == "*.")
+            pattern.remove_prefix(2), wildcard = true;
+
+        uint32_t cur = 0;
+        for_each_label_reversed(pattern, [&](std::string_view label) {
+            auto it = build_[cur].kids.find(std::string(label));
+            if (it == build_[cur].kids.end()) {
+                uint32_t id = static_cast<uint32_t>(build_.size());
+                build_[cur].kids.emplace(std::string(label), id);
+                build_.emplace_back();
+                cur = id;
+            }
+            else {
+                cur = it->second;
+            }
+            return true;
+        });
+
+        auto& slot = wildcard ? build_[cur].wildcard : build_[cur].exact;
+        if (slot[cd - 1] == fw_verdict::none)          // 同一個 pattern 重複出現時，第一條為準
+            slot[cd - 1] = v;
+    }
+
+    // 把建構用的 trie 攤平成查詢用的陣列；add() 全部做完後呼叫一次
+    void compile()
+    {
+        nodes_.clear();
+        labels_.clear();
+        if (build_.empty())
+            return;
+
+        // BFS：每個 node 的子節點在 nodes_ 裡連續排列（std::map 已依 label 排序）
+        nodes_.push_back(node{0, 0, 0, 0, build_[0].exact, build_[0].wildcard});
+        std::vector<uint32_t> order{0};
+        for (size_t i = 0; i < order.size(); ++i) {
+            const auto& b = build_[order[i]];
+            nodes_[i].first_child = static_cast<uint32_t>(nodes_.size());
+            nodes_[i].child_count = static_cast<uint32_t>(b.kids.size());
+            for (const auto& [label, id] : b.kids) {
+                nodes_.push_back(node{static_cast<uint32_t>(labels_.size()),
+                                      static_cast<uint32_t>(label.size()), 0, 0,
+                                      build_[id].exact, build_[id].wildcard});
+                labels_ += label;
+                order.push_back(id);
+            }
+        }
+        build_.clear();
+        build_.shrink_to_fit();
+    }
+
+    // domain 須為小寫、不含結尾的 '.'
+    fw_verdict match(std::string_view domain, int cd) const
+    {
+        if (nodes_.empty() || (cd != 1 && cd != 2))
+            return fw_verdict::none;
+
+        fw_verdict best = fw_verdict::none;
+        uint32_t cur = 0;
+        for_each_label_reversed(domain, [&](std::string_view label) {
+            // 目前節點的 wildcard：後面至少還有一個 label 才算符合
+            if (nodes_[cur].wildcard[cd - 1] != fw_verdict::none)
+                best = nodes_[cur].wildcard[cd - 1];
+
+            uint32_t child = find_child(cur, label);
+            if (child == kNone) {
+                cur = kNone;
+                return false;
+            }
+            cur = child;
+            return true;
+        });
+
+        if (cur != kNone && nodes_[cur].exact[cd - 1] != fw_verdict::none)
+            best = nodes_[cur].exact[cd - 1];
+        return best;
+    }
+
+    std::size_t node_count() const { return nodes_.size(); }
+
+  private:
+    static constexpr uint32_t kNone = UINT32_MAX;
+    using verdicts = std::array<fw_verdict, 2>;
+
+    struct build_node{
+        std::map<std::string, uint32_t> kids;
+        verdicts exact{fw_verdict::none, fw_verdict::none};
+        verdicts wildcard{fw_verdict::none, fw_verdict::none};
+    };
+
+    struct node{
+        uint32_t label_off;
+        uint32_t label_len;
+        uint32_t first_child;
+        uint32_t child_count;
+        verdicts exact;
+        verdicts wildcard;
+    };
+
+    // 由右而左列舉 label；fn 回傳 false 即停止
+    template<class Fn>
+    static void for_each_label_reversed(std::string_view s, Fn&& fn)
+    {
+        while (!s.empty()) {
+            std::size_t dot = s.rfind('.');
+            std::string_view label = (dot == std::string_view::npos) ? s : s.substr(dot + 1);
+            if (!label.empty() && !fn(label))
+                return;
+            if (dot == std::string_view::npos)
+                return;
+            s = s.substr(0, dot);
+        }
+    }
+
+    std::string_view label_of(const node& n) const
+    {
+        return std::string_view(labels_).substr(n.label_off, n.label_len);
+    }
+
+    uint32_t find_child(uint32_t parent, std::string_view label) const
+    {
+        const node& p = nodes_[parent];
+        auto first = nodes_.begin() + p.first_child;
+        auto last  = first + p.child_count;
+        auto it = std::lower_bound(first, last, label,
+            [this](const node& n, std::string_view l) { return label_of(n) < l; });
+        if (it == last || label_of(*it) != label)
+            return kNone;
+        return static_cast<uint32_t>(it - nodes_.begin());
+    }
+
+    std::vector<build_node> build_;
+    std::vector<node> nodes_;
+    std::string labels_;
+};
+
+// 整份 client_socks.conf 編譯後的結果
+class firewall_rules{
+  public:
+    // 檔案不存在即沒有任何規則（全部拒絕）
+    bool load(const std::string& path)
+    {
+        *this = firewall_rules{};
+        std::ifstream conf(path);
+        if (!conf)
+            return false;
+
+        std::string verb, type, pattern;
+        while (conf >> verb >> type >> pattern)      // e.g., permit c 140.113.*.*
+        {
+            int cd = (type == "c") ? 1 : (type == "b") ? 2 : 0;
+            if (cd == 0)
+                continue;
+
+            if (is_ip_pattern(pattern)) {
+                if (verb == "permit")
+                    ip_rules_[cd - 1].push_back(pattern);
+                continue;
+            }
+
+            std::transform(pattern.begin(), pattern.end(), pattern.begin(),
+                           [](unsigned char c) { return std::tolower(c); });
+            if (verb == "permit")
+                domains_.add(pattern, cd, fw_verdict::permit);
+            else if (verb == "deny")
+                domains_.add(pattern, cd, fw_verdict::deny);
+        }
+        domains_.compile();
+        return true;
+    }
+
+    fw_verdict match_domain(std::string_view domain, int cd) const
+    {
+        return domains_.match(domain, cd);
+    }
+
+    bool has_ip_rules(int cd) const
+    {
+        return (cd == 1 || cd == 2) && !ip_rules_[cd - 1].empty();
+    }
+
+    bool permits_ip(const std::string& ip, int cd) const
+    {
+        if (!has_ip_rules(cd))
+            return false;
+        for (const auto& pattern : ip_rules_[cd - 1])
+            if (match_ip(pattern, ip))
+                return true;                          // 第一條符合即通過
+        return false;
+    }
+
+    const domain_rules& domains() const { return domains_; }
+
+  private:
+    // 四段、每段是數字或 * 才當成 IP 規則
+    static bool is_ip_pattern(const std::string& pattern)
+    {
+        int parts = 0;
+        std::string_view rest = pattern;
+        while (true) {
+            std::size_t dot = rest.find('.');
+            std::string_view part = rest.substr(0, dot);
+            if (part.empty() ||
+                !(part == "*" || std::all_of(part.begin(), part.end(),
+                                             [](char c) { return c >= '0' && c <= '9'; })))
+                return false;
+            ++parts;
+            if (dot == std::string_view::npos)
+                break;
+            rest.remove_prefix(dot + 1);
+        }
+        return parts == 4;
+    }
+
+    std::array<std::vector<std::string>, 2> ip_rules_;
+    domain_rules domains_;
+};
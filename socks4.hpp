@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "firewall.hpp"
+
+/*
+** SOCKS4 / SOCKS4a 握手的純函式部分，不碰 socket，session 與 microbench / fuzz 共用。
+*/
+
+struct socks4Msg{
+  int VN = 0;
+  int CD = 0;
+  std::string S_IP;
+  std::string S_PORT;
+  std::string D_IP;
+  std::string D_PORT;
+  std::string Domain;     // SOCKS4a 的 domain（小寫），一般 SOCKS4 為空
+  std::string Command;
+  std::string Reply;
+};
+
+// 將字串依指定分隔字元切成多段，忽略空段與 \r
+inline std::vector<std::string> split_tokens(std::string_view src, char delim)
+{
+    std::vector<std::string> out;
+    std::string token;
+    std::istringstream iss{std::string(src)};   // 轉成 stream 方便 getline
+    while (std::getline(iss, token, delim)) {
+        if (!token.empty() && token.back() == '\r')
+            token.pop_back();
+        if (!token.empty())
+            out.push_back(std::move(token));
+    }
+    return out;
+}
+
+/*
+** 解析 SOCKS4_REQUEST, 把 VN, CD, dstIP, dstPort, domain name 等解出來
+** 格式正確時 Reply = "Firewall"（等待防火牆判斷），否則 Reply = "Reject"。
+** 不做 DNS 解析：SOCKS4a 的 D_IP 先放 domain，交給 apply_firewall() 決定要不要解析。
+** 來源端資訊（S_IP / S_PORT）由呼叫端從 socket 填入。
+*/
+inline bool parse_socks4_request(const uint8_t* buf, std::size_t length, socks4Msg& out)
+{
+    out.Reply = "Firewall";                          // Init
+    out.VN = length > 0 ? buf[0] : 0;
+    out.CD = 0;
+
+    // SOCKS4_REQUEST 至少要有 9 byte：VN, CD, PORT(2), IP(4), \0（USERID）
+    if (length < 9) {
+        out.Reply = "Reject";
+        return false;
+    }
+
+    if (out.VN != 4) {                               // 非 SOCKS4 直接拒絕
+        out.Reply = "Reject";
+        return false;
+    }
+
+    out.CD  = buf[1];
+    out.Command = (out.CD == 1) ? "CONNECT" : "BIND"; // CD, 1 for CONNECT, 2 for BIND
+
+    // DSTPORT, 2 bytes, Big-endian，轉換成字串
+    uint16_t dst_port = static_cast<uint16_t>((buf[2] << 8) | buf[3]);
+    out.D_PORT = std::to_string(dst_port);
+
+    // DSTIP, 4 bytes
+    // SOCKS4a，前 3 bytes 是 0，最後一byte 非 0
+    bool domain_mode = (buf[4] == 0 && buf[5] == 0 &&
+                        buf[6] == 0 && buf[7] != 0);
+
+    out.Domain.clear();
+    if (domain_mode) {                               // SOCKS4a
+        std::size_t idx = 8;
+        while (idx < length && buf[idx] != 0) ++idx; // USERID 是一串以 \0 結尾的字串，一路跳到USERID的結尾
+        ++idx;                                       // 指到 domain 首字元
+
+        while (idx < length && buf[idx] != 0)        // 把 domain 字串 一直讀到 NUL 結尾為止（轉小寫，方便比對規則）
+            out.Domain.push_back(static_cast<char>(std::tolower(buf[idx++])));
+        if (!out.Domain.empty() && out.Domain.back() == '.')
+            out.Domain.pop_back();
+
+        if (out.Domain.empty()) {                    // domain 解析失敗
+            out.Reply = "Reject";
+            return false;
+        }
+
+        // DNS 解析延到防火牆之後：被 domain 規則擋下的請求不會觸發任何解析
+        out.D_IP = out.Domain;
+    }
+
+    else {                                           // 一般 IPv4
+        out.D_IP = std::to_string(buf[4]) + '.' +
+                   std::to_string(buf[5]) + '.' +
+                   std::to_string(buf[6]) + '.' +
+                   std::to_string(buf[7]);
+    }
+    return true;
+}
+
+// 防火牆對一個已解析的請求的判斷；resolve 代表要先解析 domain，再用 IP 規則檢查每個位址
+enum class fw_decision { accept, reject, resolve };
+
+inline fw_decision evaluate_firewall(const firewall_rules& rules, const socks4Msg& req)
+{
+    if (req.Domain.empty())                          // 一般 SOCKS4，直接比對 IP 規則
+        return rules.permits_ip(req.D_IP, req.CD) ? fw_decision::accept : fw_decision::reject;
+
+    // SOCKS4a：先用原始 domain 比對 domain 規則，命中就不必為了防火牆做 DNS 解析
+    switch (rules.match_domain(req.Domain, req.CD)) {
+        case fw_verdict::permit: return fw_decision::accept;
+        case fw_verdict::deny:   return fw_decision::reject;
+        case fw_verdict::none:   break;
+    }
+    // 沒有任何 IP 規則可能符合，不必解析
+    return rules.has_ip_rules(req.CD) ? fw_decision::resolve : fw_decision::reject;
+}
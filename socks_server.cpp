@@ -10,98 +10,1168 @@
 #include <string>
 #include <map>
 #include <sstream>
+#include <array>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <mutex>
+#include <pthread.h>
+#include <cerrno>
+#include <sys/mman.h>
+#include <ctime>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+#include "socks4.hpp"
 
 using boost::asio::ip::tcp;
+using boost::asio::awaitable;
+using boost::asio::redirect_error;
+using boost::asio::use_awaitable;
 using namespace std;
 
 constexpr uint8_t kSocksGranted = 90;
 constexpr uint8_t kSocksRejected = 91;
 static constexpr std::size_t kBufSize = 10240;
+static constexpr const char* kFirewallConf = "client_socks.conf";
+static constexpr const char* kFlightDumpFile = "socks_flight.log";
+static constexpr const char* kServerConf = "socks_server.conf";
+static constexpr std::size_t kRelayChunk = 16384;   // relay 佇列每塊 chunk 的大小
+static constexpr int kFastOpenQueue = 256;         // listen socket 上還沒 accept 的 TFO 連線上限
+static constexpr uint64_t kTrafficFlushBytes = 256 * 1024;   // session 累積這麼多 bytes 才更新一次 traffic_sketch
 
-struct socks4Msg{
-  int VN;
-  int CD;
-  string S_IP;
-  string S_PORT;
-  string D_IP;
-  string D_PORT;
-  string Command;
-  string Reply;
+// 在 fork 之前配置一塊 MAP_SHARED 的匿名記憶體，Parent 與所有 Child Process 共用同一份物件
+// （每個 session 都跑在各自的 Child Process 裡，一般的全域變數無法跨連線累積資料）
+template<class T>
+static T* map_shared()
+{
+  void* p = mmap(nullptr, sizeof(T), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+  return new (p) T();
+}
+
+// 放在共享記憶體裡的 mutex（PTHREAD_PROCESS_SHARED + PTHREAD_MUTEX_ROBUST），臨界區只有幾個欄位的讀寫
+// 持有者在臨界區裡被 SIGKILL 時，kernel 會把鎖交給下一個 lock() 並回傳 EOWNERDEAD，
+// 這時標記為 consistent 繼續用（欄位最多少更新一次）；用 spinlock 的話整個 server（包括 Parent 的
+// wait_child() / SIGUSR1 dump）會永遠卡在這把鎖上
+class robust_mutex{
+  public:
+    robust_mutex()
+    {
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_init(&mutex_, &attr);
+      pthread_mutexattr_destroy(&attr);
+    }
+    robust_mutex(const robust_mutex&) = delete;
+    robust_mutex& operator=(const robust_mutex&) = delete;
+
+    void lock()
+    {
+      if (pthread_mutex_lock(&mutex_) == EOWNERDEAD)
+        pthread_mutex_consistent(&mutex_);
+    }
+    void unlock() { pthread_mutex_unlock(&mutex_); }
+
+  private:
+    pthread_mutex_t mutex_;
+};
+
+/*
+** 目的地 IP 的 connect 延遲記分板（所有 Child Process 共用）
+** 以目的地 IP 為 key，記錄 connect RTT 的 EWMA 與最近的失敗次數。
+** 大小固定：kSets 個 set、每個 set kWays 格，set 內滿了就用 CLOCK 淘汰。
+** 一個 domain 解析出多個位址時，用 order() 依分數排序後再交給 async_connect，
+** 讓重複連線穩定落在最快的那個位址上。
+*/
+class connect_scoreboard{
+  public:
+    static constexpr std::size_t kSets = 256;
+    static constexpr std::size_t kWays = 8;
+    static constexpr uint32_t kFailPenaltyUs = 1000000;   // 每次（未衰減的）失敗算 1 秒
+    static constexpr int64_t kFailHalfLifeS = 30;         // 失敗次數每 30 秒減半
+
+    void record_success(const tcp::endpoint& ep, std::chrono::microseconds rtt)
+    {
+      uint32_t sample = static_cast<uint32_t>(std::min<int64_t>(rtt.count(), UINT32_MAX));
+      update(ep, [&](entry& e) {
+        // EWMA, alpha = 1/8（與 TCP SRTT 相同）；第一筆直接採用
+        e.rtt_us = e.rtt_us == 0 ? std::max<uint32_t>(sample, 1)
+                                 : e.rtt_us - e.rtt_us / 8 + sample / 8;
+        // fails 不動：衰減一律由 last_fail_s 起算，這裡若寫回衰減後的值，score() 會再衰減一次
+      });
+    }
+
+    void record_failure(const tcp::endpoint& ep)
+    {
+      update(ep, [&](entry& e) {
+        int64_t now = now_s();
+        e.fails = std::min<uint32_t>(decayed_fails(e, now) + 1, 16);
+        e.last_fail_s = now;
+      });
+    }
+
+    // 未出現過的位址分數為 0 排在最前面（讓每個位址都有機會被量測一次），
+    // 其餘依 RTT EWMA + 失敗懲罰由小到大；同分維持 resolver 原本的順序。
+    std::vector<tcp::endpoint> order(const std::vector<tcp::endpoint>& endpoints)
+    {
+      std::vector<std::pair<uint64_t, tcp::endpoint>> scored;
+      for (const auto& ep : endpoints)
+        scored.emplace_back(score(ep), ep);
+      std::stable_sort(scored.begin(), scored.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+
+      std::vector<tcp::endpoint> out;
+      out.reserve(scored.size());
+      for (auto& s : scored)
+        out.push_back(s.second);
+      return out;
+    }
+
+  private:
+    using key_type = std::array<uint8_t, 16>;
+
+    struct entry{
+      key_type key;
+      bool     used;
+      bool     ref;            // CLOCK 的 reference bit
+      uint32_t rtt_us;         // 0 = 尚未成功連線過
+      uint32_t fails;
+      int64_t  last_fail_s;
+    };
+
+    struct set{
+      robust_mutex lock;
+      uint8_t hand;
+      std::array<entry, kWays> way;
+    };
+
+    static int64_t now_s()
+    {
+      return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static uint32_t decayed_fails(const entry& e, int64_t now)
+    {
+      int64_t halvings = (now - e.last_fail_s) / kFailHalfLifeS;
+      return halvings >= 32 ? 0 : e.fails >> halvings;
+    }
+
+    static key_type make_key(const tcp::endpoint& ep)
+    {
+      key_type k{};
+      if (ep.address().is_v4()) {
+        auto b = ep.address().to_v4().to_bytes();
+        std::copy(b.begin(), b.end(), k.begin());
+      }
+      else {
+        k = ep.address().to_v6().to_bytes();
+      }
+      return k;
+    }
+
+    set& set_of(const key_type& k)
+    {
+      uint64_t h = 1469598103934665603ull;            // FNV-1a
+      for (uint8_t b : k)
+        h = (h ^ b) * 1099511628211ull;
+      return sets_[h % kSets];
+    }
+
+    uint64_t score(const tcp::endpoint& ep)
+    {
+      key_type k = make_key(ep);
+      set& s = set_of(k);
+      std::lock_guard<robust_mutex> guard(s.lock);
+      for (auto& e : s.way)
+        if (e.used && e.key == k) {
+          e.ref = true;
+          return e.rtt_us + uint64_t(decayed_fails(e, now_s())) * kFailPenaltyUs;
+        }
+      return 0;
+    }
+
+    template<class Fn>
+    void update(const tcp::endpoint& ep, Fn&& fn)
+    {
+      key_type k = make_key(ep);
+      set& s = set_of(k);
+      std::lock_guard<robust_mutex> guard(s.lock);
+
+      entry* slot = nullptr;
+      for (auto& e : s.way)
+        if (e.used && e.key == k) { slot = &e; break; }
+
+      if (slot == nullptr) {
+        // CLOCK：ref bit 為 1 的給第二次機會，遇到 0 的就淘汰
+        while (s.way[s.hand].used && s.way[s.hand].ref) {
+          s.way[s.hand].ref = false;
+          s.hand = (s.hand + 1) % kWays;
+        }
+        slot = &s.way[s.hand];
+        s.hand = (s.hand + 1) % kWays;
+        *slot = entry{k, true, false, 0, 0, 0};
+      }
+      slot->ref = true;
+      fn(*slot);
+    }
+
+    std::array<set, kSets> sets_;
+};
+
+/*
+** Flight recorder：最近的 session 生命週期事件（所有 Child Process 共用）
+** 固定大小的 ring buffer，寫入端只做一次 fetch_add 搶位置，再用 seqlock 的方式寫入欄位，不上鎖。
+** 每筆事件 48 bytes：時間戳、pid（= session，每個 session 一個 Child）、事件種類、error code（含 category）與兩個參數。
+** Parent 收到 SIGUSR1 時把整個 ring 倒到 kFlightDumpFile，平常不需要開任何 log 就能事後查延遲。
+*/
+enum class flight_event : uint8_t{
+  accept,            // a = client IPv4, b = client port
+  parsed,            // code = VN, a = CD, b = dst port
+  firewall,          // code = 1 accept / 0 reject, a = dst IPv4（SOCKS4a 未解析時為 0）
+  resolved,          // code = error code, a = 位址數量
+  connected,         // code = error code, a = connect RTT (us), b = 嘗試過的位址數
+  bind_listen,       // a = listen port
+  bind_accepted,     // code = error code, a = peer IPv4, b = peer port
+  first_byte_up,     // client → remote 的第一筆資料，a = bytes
+  first_byte_down,   // remote → client 的第一筆資料，a = bytes
+  close,             // code = error code, a = bytes up, b = bytes down
+  backpressure,      // code = 暫停次數, a = client → remote 暫停時間 (us), b = remote → client 暫停時間 (us)
+  egress,            // code = 換了幾次來源位址, a = 來源 IPv4, b = 來源 port（只在設定了 egress 位址池時記錄）
+  admission          // code = 0 / ETIMEDOUT（排隊逾時）/ EAGAIN（FIFO 已滿）, a = 排隊時間 (us)（只在沒有直接放行時記錄）
+};
+
+class flight_recorder{
+  public:
+    static constexpr std::size_t kSlots = 8192;     // 2 的次方
+
+    // error code 的 category：resolver（netdb / addrinfo）與 asio misc 的值不是 errno，dump 時要用各自的訊息表
+    enum class error_kind : uint8_t{ none, system, netdb, addrinfo, misc, other };
+
+    void record(uint32_t session, flight_event type, const boost::system::error_code& ec, uint64_t a = 0, uint64_t b = 0)
+    {
+      record(session, type, ec.value(), a, b, kind_of(ec));
+    }
+
+    void record(uint32_t session, flight_event type, int32_t code = 0, uint64_t a = 0, uint64_t b = 0,
+                error_kind kind = error_kind::none)
+    {
+      uint64_t seq = head_.fetch_add(1, std::memory_order_relaxed) + 1;
+      slot& s = ring_[seq & (kSlots - 1)];
+      s.seq.store(0, std::memory_order_relaxed);     // 寫入中，讀取端會跳過
+      std::atomic_thread_fence(std::memory_order_release);
+      s.ts_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+      s.a.store(a, std::memory_order_relaxed);
+      s.b.store(b, std::memory_order_relaxed);
+      s.info.store(uint64_t(session) << 32 | uint64_t(uint32_t(code)) , std::memory_order_relaxed);
+      s.type.store(static_cast<uint8_t>(type), std::memory_order_relaxed);
+      s.kind.store(static_cast<uint8_t>(kind), std::memory_order_relaxed);
+      s.seq.store(seq, std::memory_order_release);
+    }
+
+    // 由舊到新輸出；每行附上相對於同一 session 第一筆事件的經過時間
+    void dump(std::ostream& out) const
+    {
+      uint64_t head  = head_.load(std::memory_order_acquire);
+      uint64_t first = head > kSlots ? head - kSlots + 1 : 1;
+      std::map<uint32_t, uint64_t> session_start;
+      for (uint64_t seq = first; seq <= head; ++seq) {
+        const slot& s = ring_[seq & (kSlots - 1)];
+        if (s.seq.load(std::memory_order_acquire) != seq)
+          continue;
+        uint64_t ts   = s.ts_ns.load(std::memory_order_relaxed);
+        uint64_t a    = s.a.load(std::memory_order_relaxed);
+        uint64_t b    = s.b.load(std::memory_order_relaxed);
+        uint64_t info = s.info.load(std::memory_order_relaxed);
+        auto type     = static_cast<flight_event>(s.type.load(std::memory_order_relaxed));
+        auto kind     = static_cast<error_kind>(s.kind.load(std::memory_order_relaxed));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.seq.load(std::memory_order_relaxed) != seq)   // 讀的途中被覆寫
+          continue;
+
+        uint32_t session = uint32_t(info >> 32);
+        int32_t  code    = int32_t(uint32_t(info));
+        uint64_t start   = session_start.emplace(session, ts).first->second;
+
+        time_t sec = time_t(ts / 1000000000);
+        char when[32];
+        std::strftime(when, sizeof(when), "%F %T", std::localtime(&sec));
+        char line[192];
+        std::snprintf(line, sizeof(line), "%s.%06llu pid=%-7u +%10.3fms  ",
+                      when, (unsigned long long)(ts % 1000000000 / 1000), session,
+                      (ts - start) / 1e6);
+        out << line << describe(type, code, kind, a, b) << '\n';
+      }
+    }
+
+  private:
+    struct slot{
+      std::atomic<uint64_t> seq{0};       // 0 = 空的或寫入中
+      std::atomic<uint64_t> ts_ns{0};
+      std::atomic<uint64_t> a{0};
+      std::atomic<uint64_t> b{0};
+      std::atomic<uint64_t> info{0};      // session << 32 | code
+      std::atomic<uint8_t>  type{0};
+      std::atomic<uint8_t>  kind{0};      // error_kind
+    };
+
+    static error_kind kind_of(const boost::system::error_code& ec)
+    {
+      const auto& c = ec.category();
+      if (!ec)
+        return error_kind::none;
+      if (c == boost::system::system_category() || c == boost::system::generic_category())
+        return error_kind::system;
+      if (c == boost::asio::error::get_netdb_category())
+        return error_kind::netdb;
+      if (c == boost::asio::error::get_addrinfo_category())
+        return error_kind::addrinfo;
+      if (c == boost::asio::error::get_misc_category())
+        return error_kind::misc;
+      return error_kind::other;
+    }
+
+    static std::string error_text(int32_t code, error_kind kind)
+    {
+      switch (kind) {
+        case error_kind::netdb:    return boost::asio::error::get_netdb_category().message(code);
+        case error_kind::addrinfo: return boost::asio::error::get_addrinfo_category().message(code);
+        case error_kind::misc:     return boost::asio::error::get_misc_category().message(code);
+        case error_kind::other:    return "unknown category";
+        default:                   return std::strerror(code);
+      }
+    }
+
+    static std::string ipv4(uint64_t ip)
+    {
+      return ip == 0 ? "-" : boost::asio::ip::address_v4(uint32_t(ip)).to_string();
+    }
+
+    static std::string describe(flight_event type, int32_t code, error_kind kind, uint64_t a, uint64_t b)
+    {
+      std::ostringstream oss;
+      auto err = [&] { return code == 0 ? std::string("ok") : std::to_string(code) + " (" + error_text(code, kind) + ")"; };
+      switch (type) {
+        case flight_event::accept:          oss << "accept          client=" << ipv4(a) << ':' << b; break;
+        case flight_event::parsed:          oss << "parsed          vn=" << code << " cd=" << a << " dport=" << b; break;
+        case flight_event::firewall:        oss << "firewall        " << (code ? "accept" : "reject") << " dst=" << ipv4(a); break;
+        case flight_event::resolved:        oss << "resolved        " << err() << " addrs=" << a; break;
+        case flight_event::connected:       oss << "connected       " << err() << " rtt_us=" << a << " tried=" << b; break;
+        case flight_event::bind_listen:     oss << "bind_listen     port=" << a; break;
+        case flight_event::bind_accepted:   oss << "bind_accepted   " << err() << " peer=" << ipv4(a) << ':' << b; break;
+        case flight_event::first_byte_up:   oss << "first_byte_up   bytes=" << a; break;
+        case flight_event::first_byte_down: oss << "first_byte_down bytes=" << a; break;
+        case flight_event::close:           oss << "close           " << err() << " up=" << a << " down=" << b; break;
+        case flight_event::backpressure:    oss << "backpressure    pauses=" << code << " up_us=" << a << " down_us=" << b; break;
+        case flight_event::egress:          oss << "egress          src=" << ipv4(a) << ':' << b << " retries=" << code; break;
+        case flight_event::admission:       oss << "admission       " << err() << " waited_us=" << a; break;
+        default:                            oss << "event#" << int(type); break;
+      }
+      return oss.str();
+    }
+
+    std::atomic<uint64_t> head_{0};
+    std::array<slot, kSlots> ring_;
+};
+
+/*
+** socks_server.conf（可省略）：啟動時讀一次，每行 <key> <value>
+**   relay_high_watermark 262144      單一方向佇列超過這個量就暫停讀取
+**   relay_low_watermark  65536       降到這個量以下才恢復讀取
+**   relay_memory_budget  268435456   所有 session 的 relay 佇列合計上限
+**   egress               10.0.0.2    上游連線的來源 IP，可以寫多行組成位址池（預設不 bind，由 kernel 決定）
+**   egress_policy        round_robin 從位址池挑來源 IP 的方式：round_robin 或 least_used（皆以目的地為單位）
+**   dest_max_connecting  0           每個目的地 IP:port 同時進行中的 connect 上限（0 = 不限制）
+**   dest_max_tunnels     0           每個目的地 IP:port 已建立的 tunnel（含進行中的 connect）上限
+**   dest_limit 10.1.*.*:443 8 200    規則定義的群組：符合的目的地共用一組上限（connect, tunnel），第一條符合為準；
+**                                    port 可省略或寫 *
+**   dest_queue_limit     32          超過上限時排隊的 FIFO 長度，排不進去直接回覆 91
+**   dest_queue_timeout_ms 3000       排隊的期限，逾時回覆 91
+*/
+
+// 一個目的地（或 dest_limit 群組）的並行上限，key 相同的連線共用同一組計數
+struct dest_policy{
+  uint64_t key = 0;
+  uint32_t max_connecting = 0;           // 0 = 不限制
+  uint32_t max_tunnels = 0;
+
+  bool limited() const { return max_connecting != 0 || max_tunnels != 0; }
+};
+
+struct server_config{
+  std::size_t relay_high_watermark = 256 * 1024;
+  std::size_t relay_low_watermark  = 64 * 1024;
+  uint64_t    relay_memory_budget  = 256ull * 1024 * 1024;
+  std::vector<boost::asio::ip::address_v4> egress;
+  bool        egress_least_used    = false;
+  uint32_t    dest_max_connecting  = 0;
+  uint32_t    dest_max_tunnels     = 0;
+  uint32_t    dest_queue_limit     = 32;
+  uint32_t    dest_queue_timeout_ms = 3000;
+
+  struct dest_rule{
+    std::string ip_pattern;
+    uint16_t port;                       // 0 = 任何 port
+    uint32_t max_connecting;
+    uint32_t max_tunnels;
+  };
+  std::vector<dest_rule> dest_limits;
+
+  // 群組的 key 是 1 << 48 | 規則編號；其他 IPv4 目的地是 ip << 16 | port，不會重疊
+  dest_policy policy_for(const tcp::endpoint& ep) const
+  {
+    std::string ip = ep.address().to_string();
+    for (std::size_t i = 0; i < dest_limits.size(); ++i) {
+      const auto& r = dest_limits[i];
+      if ((r.port == 0 || r.port == ep.port()) && match_ip(r.ip_pattern, ip))
+        return dest_policy{(1ull << 48) | i, r.max_connecting, r.max_tunnels};
+    }
+
+    uint64_t key;
+    if (ep.address().is_v4()) {
+      key = (uint64_t(ep.address().to_v4().to_uint()) << 16) | ep.port();
+    }
+    else {
+      key = 1469598103934665603ull;                 // FNV-1a，IPv6 折成 63 bits
+      for (uint8_t b : ep.address().to_v6().to_bytes())
+        key = (key ^ b) * 1099511628211ull;
+      key = ((key ^ ep.port()) * 1099511628211ull) | (1ull << 63);
+    }
+    return dest_policy{key, dest_max_connecting, dest_max_tunnels};
+  }
+
+  void load(const char* path)
+  {
+    std::ifstream conf(path);
+    std::string key, value;
+    while (conf >> key) {
+      if (key == "relay_high_watermark")     conf >> relay_high_watermark;
+      else if (key == "relay_low_watermark") conf >> relay_low_watermark;
+      else if (key == "relay_memory_budget") conf >> relay_memory_budget;
+      else if (key == "egress") {
+        boost::system::error_code ec;
+        conf >> value;
+        auto addr = boost::asio::ip::make_address_v4(value, ec);
+        if (!ec)
+          egress.push_back(addr);
+      }
+      else if (key == "egress_policy") {
+        conf >> value;
+        egress_least_used = (value == "least_used");
+      }
+      else if (key == "dest_max_connecting")   conf >> dest_max_connecting;
+      else if (key == "dest_max_tunnels")      conf >> dest_max_tunnels;
+      else if (key == "dest_queue_limit")      conf >> dest_queue_limit;
+      else if (key == "dest_queue_timeout_ms") conf >> dest_queue_timeout_ms;
+      else if (key == "dest_limit") {          // dest_limit <ip-pattern>[:port] <max_connecting> <max_tunnels>
+        dest_rule r{};
+        conf >> value >> r.max_connecting >> r.max_tunnels;
+        std::size_t colon = value.find(':');
+        r.ip_pattern = value.substr(0, colon);
+        if (colon != std::string::npos && value.substr(colon + 1) != "*")
+          r.port = static_cast<uint16_t>(std::atoi(value.c_str() + colon + 1));
+        dest_limits.push_back(std::move(r));
+      }
+      else std::getline(conf, key);      // 不認得的 key 整行略過
+    }
+    relay_high_watermark = std::max(relay_high_watermark, kRelayChunk);
+    relay_low_watermark  = std::min(relay_low_watermark, relay_high_watermark / 2);
+  }
+};
+
+/*
+** 全部 session 共用的 relay 記憶體預算
+** 每個 relay chunk 配置之前先 try_reserve()，寫完釋放時 release()；
+** 預算用完時讀取端暫停，等自己或其他 session 的佇列消化掉再繼續。
+** 同時累計被 backpressure 擋住的次數與時間，SIGUSR1 時跟 flight recorder 一起輸出。
+*/
+class relay_budget{
+  public:
+    void set_limit(uint64_t limit) { limit_.store(limit, std::memory_order_relaxed); }
+
+    bool try_reserve(uint64_t n)
+    {
+      uint64_t used = used_.fetch_add(n, std::memory_order_relaxed) + n;
+      if (used > limit_.load(std::memory_order_relaxed)) {
+        used_.fetch_sub(n, std::memory_order_relaxed);
+        return false;
+      }
+      uint64_t peak = peak_.load(std::memory_order_relaxed);
+      while (used > peak && !peak_.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+      return true;
+    }
+
+    void release(uint64_t n) { used_.fetch_sub(n, std::memory_order_relaxed); }
+
+    // watermark = true：單一方向的佇列滿了；false：全域預算用完
+    void add_backpressure(bool watermark, std::chrono::nanoseconds paused)
+    {
+      (watermark ? watermark_pauses_ : budget_pauses_).fetch_add(1, std::memory_order_relaxed);
+      (watermark ? watermark_ns_ : budget_ns_).fetch_add(paused.count(), std::memory_order_relaxed);
+    }
+
+    void report(std::ostream& out) const
+    {
+      out << "# relay memory: used=" << used_.load() << " peak=" << peak_.load()
+          << " budget=" << limit_.load() << '\n'
+          << "# backpressure: watermark pauses=" << watermark_pauses_.load()
+          << " (" << watermark_ns_.load() / 1000000 << " ms), budget pauses=" << budget_pauses_.load()
+          << " (" << budget_ns_.load() / 1000000 << " ms)\n";
+    }
+
+  private:
+    std::atomic<uint64_t> limit_{0};
+    std::atomic<uint64_t> used_{0};
+    std::atomic<uint64_t> peak_{0};
+    std::atomic<uint64_t> watermark_pauses_{0};
+    std::atomic<uint64_t> watermark_ns_{0};
+    std::atomic<uint64_t> budget_pauses_{0};
+    std::atomic<uint64_t> budget_ns_{0};
+};
+
+/*
+** 上游連線的來源位址池（所有 Child Process 共用）
+** 連到同一個目的地 IP:port 的連線只能靠來源 (IP, port) 區分，只用一個來源 IP 時熱門目的地很快就把
+** ephemeral port 用完，connect 回 EADDRNOTAVAIL。每多一個來源 IP，可用的 4-tuple 就多一份。
+** bind 時設 IP_BIND_ADDRESS_NO_PORT，port 延到 connect 時才由 kernel 依完整的 4-tuple 挑，
+** 不會因為 bind 先佔住 port 而讓不同目的地互相搶 port。
+** 目的地依 hash 分到 kBuckets 個桶，每個桶記錄各來源位址使用中的連線數與 round-robin 游標；
+** least_used 挑該目的地使用中最少的位址，round_robin 依游標輪流。
+*/
+class egress_pool{
+  public:
+    static constexpr std::size_t kMaxAddrs = 32;
+    static constexpr std::size_t kBuckets  = 256;
+
+    void configure(const std::vector<boost::asio::ip::address_v4>& addrs, bool least_used)
+    {
+      count_ = static_cast<uint32_t>(std::min(addrs.size(), kMaxAddrs));
+      for (uint32_t i = 0; i < count_; ++i)
+        addrs_[i] = addrs[i].to_uint();
+      least_used_ = least_used;
+    }
+
+    bool empty() const { return count_ == 0; }
+
+    boost::asio::ip::address_v4 address(int idx) const { return boost::asio::ip::address_v4(addrs_[idx]); }
+
+    // 挑一個來源位址並把它算進使用中；tried 是這次連線已經失敗過的位址（bitmask），都試過了回傳 -1
+    int acquire(const tcp::endpoint& dst, uint32_t tried)
+    {
+      bucket& b = bucket_of(dst);
+      uint32_t start = b.cursor.fetch_add(1, std::memory_order_relaxed);
+      int pick = -1;
+      uint32_t best = UINT32_MAX;
+      for (uint32_t k = 0; k < count_; ++k) {
+        uint32_t i = (start + k) % count_;
+        if (tried & (1u << i))
+          continue;
+        if (!least_used_) {                  // round_robin：游標之後第一個還沒試過的
+          pick = static_cast<int>(i);
+          break;
+        }
+        uint32_t n = b.in_use[i].load(std::memory_order_relaxed);
+        if (n < best)                          // 同樣少時取游標之後的第一個，讓平手的位址輪流
+          best = n, pick = static_cast<int>(i);
+      }
+      if (pick >= 0) {
+        b.in_use[pick].fetch_add(1, std::memory_order_relaxed);
+        connects_[pick].fetch_add(1, std::memory_order_relaxed);
+      }
+      return pick;
+    }
+
+    void release(const tcp::endpoint& dst, int idx)
+    {
+      bucket_of(dst).in_use[idx].fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // 這個來源位址對某個目的地的 port 用完了（或根本不是本機位址）
+    void record_unavailable(int idx)
+    {
+      unavailable_[idx].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void report(std::ostream& out) const
+    {
+      for (uint32_t i = 0; i < count_; ++i) {
+        uint64_t in_use = 0;
+        for (const auto& b : buckets_)
+          in_use += b.in_use[i].load(std::memory_order_relaxed);
+        out << "# egress " << address(i).to_string() << ": in_use=" << in_use
+            << " connects=" << connects_[i].load() << " unavailable=" << unavailable_[i].load() << '\n';
+      }
+    }
+
+  private:
+    struct bucket{
+      std::atomic<uint32_t> cursor{0};
+      std::array<std::atomic<uint32_t>, kMaxAddrs> in_use{};
+    };
+
+    bucket& bucket_of(const tcp::endpoint& dst)
+    {
+      uint64_t h = 1469598103934665603ull;            // FNV-1a，key 是 IPv4 + port
+      uint64_t key = (uint64_t(dst.address().to_v4().to_uint()) << 16) | dst.port();
+      for (int i = 0; i < 6; ++i)
+        h = (h ^ ((key >> (8 * i)) & 0xFF)) * 1099511628211ull;
+      return buckets_[h % kBuckets];
+    }
+
+    std::array<uint32_t, kMaxAddrs> addrs_{};
+    uint32_t count_ = 0;
+    bool least_used_ = false;
+    std::array<bucket, kBuckets> buckets_;
+    std::array<std::atomic<uint64_t>, kMaxAddrs> connects_{};
+    std::array<std::atomic<uint64_t>, kMaxAddrs> unavailable_{};
+};
+
+/*
+** 每個目的地的並行上限與排隊（所有 Child Process 共用）
+** 一大批 CONNECT 湧向同一個後端時，只讓 max_connecting 個 connect 同時進行、
+** 已建立的 tunnel（含進行中的 connect）不超過 max_tunnels，其餘依到達順序排進該目的地的 FIFO。
+** FIFO 用排隊號碼實作：[head, tail) 是還在排的號碼，每個位置只記期限；
+** 放棄（逾時）的位置把期限清成 0，輪到它時直接跳過，Child 異常結束留下的位置也會因為過期被跳過。
+** 跨 Process 沒辦法通知，排隊中的 session 每 kPollInterval 檢查一次是否輪到自己。
+** 大小固定：kSets 個 set、每個 set kWays 個目的地，只有完全閒置（沒有 connect / tunnel / 排隊）的格子會被換掉。
+*/
+class dest_limiter{
+  public:
+    static constexpr std::size_t kSets = 256;
+    static constexpr std::size_t kWays = 4;
+    static constexpr uint32_t kQueueMax = 64;
+    static constexpr auto kPollInterval = std::chrono::milliseconds(2);
+
+    // untracked：set 滿了沒有格子記這個目的地，放行但沒有計數，之後不能 connect_done() / tunnel_closed()
+    enum class result{ granted, untracked, queued, rejected };
+
+    // connect 之前呼叫：有空位而且沒有人在排隊就 granted；否則排進 FIFO（seq 是排隊號碼）；FIFO 滿了 rejected
+    result enter(const dest_policy& p, uint32_t queue_limit, std::chrono::steady_clock::time_point deadline, uint32_t& seq)
+    {
+      set& s = set_of(p.key);
+      std::lock_guard<robust_mutex> guard(s.lock);
+      entry* e = find(s, p.key, true);
+      if (e == nullptr) {                    // set 裡每一格都在用，這個目的地沒辦法追蹤，直接放行
+        untracked_.fetch_add(1, std::memory_order_relaxed);
+        return result::untracked;
+      }
+
+      drop_expired(*e, now_ns());
+      if (e->head == e->tail && has_room(*e, p)) {
+        ++e->connecting;
+        return result::granted;
+      }
+      if (e->tail - e->head >= std::min(queue_limit, kQueueMax)) {
+        queue_full_.fetch_add(1, std::memory_order_relaxed);
+        return result::rejected;
+      }
+      seq = e->tail++;
+      e->queue[seq % kQueueMax] = deadline.time_since_epoch().count();
+      queued_.fetch_add(1, std::memory_order_relaxed);
+      return result::queued;
+    }
+
+    // 排隊中定期呼叫：輪到自己而且有空位就 granted；過了期限就讓出位置並回傳 rejected
+    result poll(const dest_policy& p, uint32_t seq, std::chrono::steady_clock::time_point deadline)
+    {
+      set& s = set_of(p.key);
+      std::lock_guard<robust_mutex> guard(s.lock);
+      entry* e = find(s, p.key, false);
+      int64_t now = now_ns();
+      bool in_queue = e != nullptr && int32_t(seq - e->head) >= 0 && int32_t(e->tail - seq) > 0;
+
+      if (!in_queue || now >= deadline.time_since_epoch().count()) {
+        if (in_queue)
+          e->queue[seq % kQueueMax] = 0;
+        timed_out_.fetch_add(1, std::memory_order_relaxed);
+        return result::rejected;
+      }
+      drop_expired(*e, now);
+      if (e->head == seq && has_room(*e, p)) {
+        ++e->head;
+        ++e->connecting;
+        return result::granted;
+      }
+      return result::queued;
+    }
+
+    // connect 結束：進行中的 connect 減一，成功的話轉成 tunnel
+    void connect_done(const dest_policy& p, bool established)
+    {
+      update(p.key, [&](entry& e) {
+        if (e.connecting > 0)
+          --e.connecting;
+        if (established)
+          ++e.tunnels;
+      });
+    }
+
+    void tunnel_closed(const dest_policy& p)
+    {
+      update(p.key, [](entry& e) {
+        if (e.tunnels > 0)
+          --e.tunnels;
+      });
+    }
+
+    void add_wait(std::chrono::nanoseconds waited)
+    {
+      wait_ns_.fetch_add(waited.count(), std::memory_order_relaxed);
+    }
+
+    // 全域統計，再列出目前有 connect / tunnel / 排隊的目的地
+    void report(std::ostream& out)
+    {
+      out << "# admission: queued=" << queued_.load() << " timed_out=" << timed_out_.load()
+          << " queue_full=" << queue_full_.load() << " untracked=" << untracked_.load()
+          << " wait=" << wait_ns_.load() / 1000000 << " ms\n";
+      int64_t now = now_ns();
+      for (auto& s : sets_) {
+        std::lock_guard<robust_mutex> guard(s.lock);
+        for (auto& e : s.way) {
+          drop_expired(e, now);
+          if (e.key != 0 && !idle(e))
+            out << "# dest " << describe_key(e.key) << ": connecting=" << e.connecting
+                << " tunnels=" << e.tunnels << " waiting=" << (e.tail - e.head) << '\n';
+        }
+      }
+    }
+
+  private:
+    struct entry{
+      uint64_t key;                          // 0 = 空格
+      uint32_t connecting;
+      uint32_t tunnels;
+      uint32_t head;
+      uint32_t tail;
+      std::array<int64_t, kQueueMax> queue;  // 每個排隊位置的期限（steady_clock ns），0 = 已放棄
+    };
+
+    struct set{
+      robust_mutex lock;
+      std::array<entry, kWays> way;
+    };
+
+    static int64_t now_ns()
+    {
+      return std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+
+    static bool has_room(const entry& e, const dest_policy& p)
+    {
+      return (p.max_connecting == 0 || e.connecting < p.max_connecting) &&
+             (p.max_tunnels == 0 || e.connecting + e.tunnels < p.max_tunnels);
+    }
+
+    static bool idle(const entry& e)
+    {
+      return e.connecting == 0 && e.tunnels == 0 && e.head == e.tail;
+    }
+
+    // 排在最前面、已經放棄或過期的位置直接跳過
+    static void drop_expired(entry& e, int64_t now)
+    {
+      while (e.head != e.tail && e.queue[e.head % kQueueMax] <= now)
+        ++e.head;
+    }
+
+    static std::string describe_key(uint64_t key)
+    {
+      if (key >> 63)
+        return "ipv6#" + std::to_string(key & 0xFFFF);
+      if (key >> 48)
+        return "group#" + std::to_string(key & 0xFFFF);
+      return boost::asio::ip::address_v4(uint32_t(key >> 16)).to_string() + ':' + std::to_string(key & 0xFFFF);
+    }
+
+    set& set_of(uint64_t key)
+    {
+      uint64_t h = key * 0x9E3779B97F4A7C15ull;      // Fibonacci hashing
+      return sets_[(h >> 32) % kSets];
+    }
+
+    // claim = true 時找不到就佔用一個閒置的格子
+    entry* find(set& s, uint64_t key, bool claim)
+    {
+      entry* free_slot = nullptr;
+      for (auto& e : s.way) {
+        if (e.key == key)
+          return &e;
+        if (free_slot == nullptr && (e.key == 0 || idle(e)))
+          free_slot = &e;
+      }
+      if (!claim || free_slot == nullptr)
+        return nullptr;
+      free_slot->key = key;
+      free_slot->connecting = free_slot->tunnels = 0;
+      free_slot->head = free_slot->tail = 0;
+      return free_slot;
+    }
+
+    template<class Fn>
+    void update(uint64_t key, Fn&& fn)
+    {
+      set& s = set_of(key);
+      std::lock_guard<robust_mutex> guard(s.lock);
+      if (entry* e = find(s, key, false))
+        fn(*e);
+    }
+
+    std::array<set, kSets> sets_;
+    std::atomic<uint64_t> queued_{0};
+    std::atomic<uint64_t> timed_out_{0};
+    std::atomic<uint64_t> queue_full_{0};
+    std::atomic<uint64_t> untracked_{0};
+    std::atomic<uint64_t> wait_ns_{0};
+};
+
+/*
+** 流量的 heavy hitter 統計（所有 Child Process 共用）
+** 精確記錄每一組 (來源, 目的地) 的用量太占記憶體，改用固定大小的 count-min sketch 估計每個 key 的
+** bytes 與連線數，再為三種 key（來源 IP、目的 IP、來源 → 目的）各維護一個 top-K min-heap。
+** count-min 只會高估，誤差上限約為總量 × e / kWidth；heap 裡的值是當下的估計值。
+** relay 每個 chunk 只在 session 裡累加 byte 數（本來就有的 bytes_up_ / bytes_down_），
+** 累積超過 kTrafficFlushBytes 或 session 結束時才呼叫一次 add()。
+*/
+class traffic_sketch{
+  public:
+    enum kind : uint8_t { by_src, by_dst, by_pair, kKinds };
+    static constexpr std::size_t kDepth = 4;
+    static constexpr std::size_t kWidth = 4096;
+    static constexpr std::size_t kTopK  = 16;
+
+    // 一個 session 的一段流量；src / dst 是 IPv4
+    void add(uint32_t src, uint32_t dst, uint64_t bytes, uint64_t conns)
+    {
+      update(by_src, src, bytes, conns);
+      update(by_dst, dst, bytes, conns);
+      update(by_pair, (uint64_t(src) << 32) | dst, bytes, conns);
+    }
+
+    // 每種 key 依估計的 bytes 由大到小列出前 n 名
+    void report(std::ostream& out, std::size_t n = 10)
+    {
+      static constexpr const char* kNames[kKinds] = {"src", "dst", "pair"};
+      for (int k = 0; k < kKinds; ++k) {
+        std::array<hitter, kTopK> top;
+        uint32_t size;
+        {
+          std::lock_guard<robust_mutex> guard(top_[k].lock);
+          top  = top_[k].heap;
+          size = top_[k].size;
+        }
+        std::sort(top.begin(), top.begin() + size,
+                  [](const hitter& a, const hitter& b) { return a.bytes > b.bytes; });
+        for (uint32_t i = 0; i < std::min<std::size_t>(size, n); ++i)
+          out << "# top " << kNames[k] << ' ' << describe(kind(k), top[i].key)
+              << ": bytes=" << top[i].bytes << " conns=" << estimate(conns_, kind(k), top[i].key) << '\n';
+      }
+    }
+
+  private:
+    using sketch = std::array<std::array<std::atomic<uint64_t>, kWidth>, kDepth>;
+
+    struct hitter{
+      uint64_t key;
+      uint64_t bytes;
+    };
+
+    struct top_k{
+      robust_mutex lock;
+      uint32_t size = 0;
+      std::array<hitter, kTopK> heap;        // min-heap（依 bytes），heap[0] 是目前最小的
+    };
+
+    // splitmix64；每種 key、每一列用不同的 seed
+    static std::size_t column(kind k, uint64_t key, std::size_t row)
+    {
+      uint64_t h = key ^ ((uint64_t(k) * kDepth + row + 1) * 0x9E3779B97F4A7C15ull);
+      h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+      h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+      return (h ^ (h >> 31)) % kWidth;
+    }
+
+    static uint64_t estimate(const sketch& sk, kind k, uint64_t key)
+    {
+      uint64_t est = UINT64_MAX;
+      for (std::size_t row = 0; row < kDepth; ++row)
+        est = std::min(est, sk[row][column(k, key, row)].load(std::memory_order_relaxed));
+      return est;
+    }
+
+    static std::string describe(kind k, uint64_t key)
+    {
+      auto ip = [](uint64_t v) { return boost::asio::ip::address_v4(uint32_t(v)).to_string(); };
+      return k == by_pair ? ip(key >> 32) + " -> " + ip(key) : ip(key);
+    }
+
+    void update(kind k, uint64_t key, uint64_t bytes, uint64_t conns)
+    {
+      uint64_t est = UINT64_MAX;
+      for (std::size_t row = 0; row < kDepth; ++row) {
+        std::size_t col = column(k, key, row);
+        est = std::min(est, bytes_[row][col].fetch_add(bytes, std::memory_order_relaxed) + bytes);
+        conns_[row][col].fetch_add(conns, std::memory_order_relaxed);
+      }
+      offer(top_[k], key, est);
+    }
+
+    static void offer(top_k& t, uint64_t key, uint64_t est)
+    {
+      auto greater = [](const hitter& a, const hitter& b) { return a.bytes > b.bytes; };
+      auto first = t.heap.begin();
+      std::lock_guard<robust_mutex> guard(t.lock);
+      for (uint32_t i = 0; i < t.size; ++i)
+        if (t.heap[i].key == key) {            // 已經在 heap 裡：更新估計值後重新整理
+          t.heap[i].bytes = std::max(t.heap[i].bytes, est);
+          std::make_heap(first, first + t.size, greater);
+          return;
+        }
+      if (t.size < kTopK) {
+        t.heap[t.size++] = hitter{key, est};
+        std::push_heap(first, first + t.size, greater);
+      }
+      else if (est > t.heap[0].bytes) {        // 取代目前最小的
+        std::pop_heap(first, first + t.size, greater);
+        t.heap[t.size - 1] = hitter{key, est};
+        std::push_heap(first, first + t.size, greater);
+      }
+    }
+
+    sketch bytes_;
+    sketch conns_;
+    std::array<top_k, kKinds> top_;
+};
+
+/*
+** 每個 Child Process 手上的共享資源（以 pid 為 key，所有 Child Process 共用）
+** dest_limiter 的 connect / tunnel 名額、egress 位址、relay 預算平常由 session 自己歸還，
+** 但 Child 被 SIGKILL 或 crash 時來不及歸還，計數就永遠少一格。
+** Child 每拿到或歸還一樣資源就同步記在自己的格子，Parent 在 wait_child() 回收該 pid 時
+** 把格子裡還記著的部份代為歸還（shared_state::reclaim()）再清空格子。
+** 格子依 pid 線性探測；表滿時這個 Child 不追蹤（跟 dest_limiter 的 set 滿時一樣放行）。
+** 欄位只有擁有的 Child 會寫，Parent 在它結束後才讀，不需要鎖。
+*/
+class child_holdings{
+  public:
+    static constexpr std::size_t kSlots = 4096;
+
+    struct slot{
+      std::atomic<pid_t> pid{0};             // 0 = 空格
+      uint64_t dest_key = 0;                 // dest_limiter 的 key
+      bool dest_connecting = false;          // 佔著一個 connect 名額
+      bool dest_tunnel = false;              // 佔著一個 tunnel 名額
+      int egress_idx = -1;                   // 佔用的 egress 位址，-1 = 沒有
+      tcp::endpoint egress_dst;
+      uint64_t relay_bytes = 0;              // 向 relay_budget 預留中的 bytes
+    };
+
+    // Child 開始時呼叫；表滿回傳 nullptr
+    slot* claim(pid_t pid)
+    {
+      for (std::size_t i = 0; i < kSlots; ++i) {
+        slot& s = slots_[(std::size_t(pid) + i) % kSlots];
+        pid_t expected = 0;
+        if (s.pid.compare_exchange_strong(expected, pid, std::memory_order_acq_rel))
+          return &s;
+      }
+      untracked_.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    slot* find(pid_t pid)
+    {
+      for (std::size_t i = 0; i < kSlots; ++i) {
+        slot& s = slots_[(std::size_t(pid) + i) % kSlots];
+        if (s.pid.load(std::memory_order_acquire) == pid)
+          return &s;
+      }
+      return nullptr;
+    }
+
+    // Parent 回收完之後清空；held = 這個 Child 結束時還沒歸還任何資源
+    void release(slot& s, bool held)
+    {
+      if (held)
+        reclaimed_.fetch_add(1, std::memory_order_relaxed);
+      s.dest_key = 0;
+      s.dest_connecting = s.dest_tunnel = false;
+      s.egress_idx = -1;
+      s.relay_bytes = 0;
+      s.pid.store(0, std::memory_order_release);
+    }
+
+    void report(std::ostream& out) const
+    {
+      out << "# reclaimed: children=" << reclaimed_.load() << " untracked=" << untracked_.load() << '\n';
+    }
+
+  private:
+    std::array<slot, kSlots> slots_;
+    std::atomic<uint64_t> reclaimed_{0};
+    std::atomic<uint64_t> untracked_{0};
+};
+
+// 所有 Child Process 共用的狀態，main() 在建立 server 之前以 map_shared() 配置
+struct shared_state{
+  connect_scoreboard scoreboard;
+  flight_recorder recorder;
+  relay_budget relay;
+  egress_pool egress;
+  dest_limiter limiter;
+  traffic_sketch traffic;
+  child_holdings holdings;
+
+  // Parent 回收 Child 時呼叫：它還沒歸還的名額、egress 位址與 relay 預算代為歸還
+  void reclaim(pid_t pid)
+  {
+    child_holdings::slot* s = holdings.find(pid);
+    if (s == nullptr)
+      return;
+    dest_policy p;
+    p.key = s->dest_key;
+    if (s->dest_connecting)
+      limiter.connect_done(p, false);
+    if (s->dest_tunnel)
+      limiter.tunnel_closed(p);
+    if (s->egress_idx >= 0)
+      egress.release(s->egress_dst, s->egress_idx);
+    if (s->relay_bytes > 0)
+      relay.release(s->relay_bytes);
+    holdings.release(*s, s->dest_connecting || s->dest_tunnel || s->egress_idx >= 0 || s->relay_bytes > 0);
+  }
 };
 
-class session : public std::enable_shared_from_this<session>{
+/*
+** 每個 session 是一條 C++20 coroutine（boost::asio::awaitable）：
+** 握手 → 防火牆 → CONNECT / BIND → 雙向 relay 寫成一段直線流程。
+** session 物件由 serve() 的 coroutine frame 持有（unique_ptr），是唯一的擁有者；
+** 不再於每個 async 操作的 handler 裡複製 shared_from_this()，省下每次 I/O 的 atomic 加減與 handler 配置。
+** coroutine frame 由 Asio 的 awaitable frame recycling（thread_info_base 快取）回收重用。
+*/
+class session{
   public:
-    session(tcp::socket socket, boost::asio::io_context& io_context)
-     : client_socket_(std::move(socket)), remote_socket_(io_context), resolver_(io_context), io_context_(io_context){}
+    session(tcp::socket socket, boost::asio::io_context& io_context, shared_state& shared,
+            const firewall_rules& rules, const server_config& config)
+     : client_socket_(std::move(socket)), remote_socket_(io_context), resolver_(io_context), io_context_(io_context), shared_(shared), rules_(rules),
+       config_(config), holding_(shared.holdings.claim(getpid())), session_id_(static_cast<uint32_t>(getpid())),
+       up_(io_context, bytes_up_, flight_event::first_byte_up), down_(io_context, bytes_down_, flight_event::first_byte_down),
+       pumps_done_timer_(io_context){}
 
-    void start()
+    // co_spawn(io_context, session::serve(std::make_unique<session>(...)), detached)
+    static awaitable<void> serve(std::unique_ptr<session> self)
     {
-      // 直接呼叫read_client_request()
-      read_client_request();
+      co_await self->run();
     }
 
   private:
-    void read_client_request()
+    awaitable<void> run()
     {
-      auto self(shared_from_this());
-      
+      boost::system::error_code ec;
+      auto peer = client_socket_.remote_endpoint(ec);
+      trace(flight_event::accept, 0, ipv4_of(peer.address()), peer.port());
+
       recv_buf_.fill(0);
       // 非同步讀取Client端送來的 SOCKS4_REQUEST
-      client_socket_.async_read_some(boost::asio::buffer(recv_buf_), 
-        [this, self](boost::system::error_code ec, std::size_t length){
-          if (!ec)
-          {
-            // 呼叫 parse_request() 去解析 SOCKS4_REQUEST, 把 VN, CD, dstIP, dstPort, domain name 等解出來
-            parse_request(int(length));
+      std::size_t length = co_await client_socket_.async_read_some(
+        boost::asio::buffer(recv_buf_), redirect_error(use_awaitable, ec));
+      if (ec) {
+        close_session(ec);
+        co_return;
+      }
 
-            if (request_.VN != 4) {
-              close_session();
-              return;
-            }
+      // 呼叫 parse_request() 去解析 SOCKS4_REQUEST, 把 VN, CD, dstIP, dstPort, domain name 等解出來
+      parse_request(length);
+      trace(flight_event::parsed, request_.VN, request_.CD, std::atoi(request_.D_PORT.c_str()));
 
-            apply_firewall();
+      if (request_.VN != 4) {
+        close_session();
+        co_return;
+      }
 
-            log_request();
-            reply_buf_[0] = 0;           // VN
+      co_await apply_firewall();
+      {
+        boost::system::error_code ec_ip;
+        auto dst = boost::asio::ip::make_address(request_.D_IP, ec_ip);   // SOCKS4a 未解析時是 domain
+        trace(flight_event::firewall, request_.Reply == "Accept", ec_ip ? 0 : ipv4_of(dst));
+      }
 
-            if(request_.Reply == "Accept"){
-              reply_buf_[1] = kSocksGranted;  // CD, 90 = request granted
+      log_request();
+      reply_buf_[0] = 0;           // VN
 
-              if(request_.CD == 1){
-                start_connect_to_remote();
-              }
-              else{ // CD == 2, Bind
-                start_bind();
-              }
-            }
+      if (request_.Reply != "Accept") {   // Reject
+        reply_buf_[1] = kSocksRejected;   // CD, 91 = request rejected or failed
+        co_await write_reply();
+        close_session();                  // 回覆後就斷線
+        co_return;
+      }
 
-            else{     // Reject
-              reply_buf_[1] = kSocksRejected; // CD, 91 = request rejected or failed
-              write_reply_and_shutdown();
-              return;
-            }
-          }
-        }
-      );
+      reply_buf_[1] = kSocksGranted;      // CD, 90 = request granted
+      bool ready = (request_.CD == 1) ? co_await connect_to_remote()
+                                      : co_await bind_remote();   // CD == 2, Bind
+      if (ready)
+        co_await relay();
     }
 
-    void close_session()
+    void trace(flight_event type, int32_t code = 0, uint64_t a = 0, uint64_t b = 0)
     {
+      shared_.recorder.record(session_id_, type, code, a, b);
+    }
+
+    // 失敗原因一律傳 error_code，flight recorder 連同 category 一起記
+    void trace(flight_event type, const boost::system::error_code& ec, uint64_t a = 0, uint64_t b = 0)
+    {
+      shared_.recorder.record(session_id_, type, ec, a, b);
+    }
+
+    static uint64_t ipv4_of(const boost::asio::ip::address& addr)
+    {
+      return addr.is_v4() ? addr.to_v4().to_uint() : 0;
+    }
+
+    // 兩個方向都可能出錯而各呼叫一次，只記錄第一次（真正的原因）
+    void close_session(const boost::system::error_code& ec = {})
+    {
+      if (!closed_) {
+        closed_ = true;
+        if (egress_idx_ >= 0)
+          release_egress(egress_dst_, egress_idx_);
+        if (tunnel_held_) {
+          shared_.limiter.tunnel_closed(limit_);
+          if (holding_)
+            holding_->dest_tunnel = false;
+        }
+        if (traffic_tracked_)
+          account_traffic();
+        trace(flight_event::close, ec == boost::asio::error::eof ? boost::system::error_code{} : ec, bytes_up_, bytes_down_);
+        if (up_.pauses + down_.pauses > 0)
+          trace(flight_event::backpressure, up_.pauses + down_.pauses,
+                std::chrono::duration_cast<std::chrono::microseconds>(up_.paused).count(),
+                std::chrono::duration_cast<std::chrono::microseconds>(down_.paused).count());
+      }
       boost::system::error_code _;
       client_socket_.close(_);
       remote_socket_.close(_);
+      up_.wake_all();                // 讓等待水位 / 預算的 pump 醒來結束
+      down_.wake_all();
       // Child process 會因 io_context.run() 結束而自然 return main()
     }
 
-    void write_reply_and_shutdown()
+    // 把 reply_buf_ 的 8 bytes 回覆給 client
+    awaitable<boost::system::error_code> write_reply()
     {
-      auto self(shared_from_this());
-      boost::asio::async_write(
-        client_socket_, boost::asio::buffer(reply_buf_),
-        [this, self](boost::system::error_code ec, size_t length)
-        {
-          close_session();             // 回覆後就斷線
-        });
+      boost::system::error_code ec;
+      co_await boost::asio::async_write(client_socket_, boost::asio::buffer(reply_buf_),
+                                        redirect_error(use_awaitable, ec));
+      co_return ec;
     }
     
     void log_request() {
@@ -115,51 +1185,177 @@ class session : public std::enable_shared_from_this<session>{
       std::cout << oss.str() << std::flush;
     }
     
-    void start_connect_to_remote()
+    // 連上遠端並回覆 90；失敗時回覆 91 並關閉，回傳 false
+    awaitable<bool> connect_to_remote()
     {
-        auto self = shared_from_this();
-    
-        // 1. 非同步 DNS 解析
-        resolver_.async_resolve(
-            request_.D_IP, request_.D_PORT,
-            [this, self](const boost::system::error_code& ec,
-                         tcp::resolver::results_type endpoints)
-        {
+        boost::system::error_code ec;
+
+        // SOCKS4a 若已經為了 IP 規則解析過 domain，直接用通過防火牆的那些位址
+        if (resolved_.empty()) {
+            // 1. 非同步 DNS 解析
+            auto endpoints = co_await resolver_.async_resolve(
+                request_.D_IP, request_.D_PORT, redirect_error(use_awaitable, ec));
+            trace(flight_event::resolved, ec, endpoints.size());
             if (ec) {                           // DNS 解析失敗
-                self->fail_connect("resolve: " + ec.message());
-                return;
+                co_await fail_reply(ec);
+                co_return false;
             }
-    
-            // 2. 非同步 connect 到遠端主機
-            boost::asio::async_connect(
-                remote_socket_, endpoints,
-                [this, self](const boost::system::error_code& ec_conn,
-                             const tcp::endpoint&)
-            {
-                if (ec_conn) {                  // 連線失敗
-                    self->fail_connect("connect: " + ec_conn.message());
-                    return;
+            for (const auto& r : endpoints)
+                resolved_.push_back(r.endpoint());
+        }
+
+        // 依記分板把候選位址排序：最快、最近沒失敗的放前面
+        candidates_ = shared_.scoreboard.order(resolved_);
+
+        // 2. 依序非同步 connect 每個候選位址，量測每個位址的 RTT / 失敗
+        //    每次 connect 之前先通過該目的地的並行上限，整個請求共用同一個排隊期限
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(config_.dest_queue_timeout_ms);
+        tcp::endpoint ep;
+        for (const auto& next : candidates_) {
+            ++attempts_;
+            ec = co_await admit(next, deadline);
+            if (ec)
+                break;
+            if (limit_.limited() && holding_) {
+                holding_->dest_key = limit_.key;
+                holding_->dest_connecting = true;
+            }
+            ec = co_await connect_one(next);
+            if (limit_.limited()) {
+                shared_.limiter.connect_done(limit_, !ec);
+                tunnel_held_ = !ec;
+                if (holding_) {
+                    holding_->dest_connecting = false;
+                    holding_->dest_tunnel = tunnel_held_;
                 }
-    
-                reply_buf_.fill(0);
-                reply_buf_[1] = kSocksGranted;  // 90
-                async_write_reply_then([self] {
-                    self->start_relay();             // 連線成功，開始轉送
-                });
-            });
-        });
-    }    
+            }
+            if (!ec) {
+                ep = next;
+                break;
+            }
+            if (ec == boost::asio::error::operation_aborted)
+                break;
+            if (ec != boost::system::errc::address_not_available)   // 本機來源位址的問題，不算目的地失敗
+                shared_.scoreboard.record_failure(next);
+        }
+        if (candidates_.empty())
+            ec = boost::asio::error::host_not_found;
 
-    void fail_connect(std::string_view reason)
+        if (ec) {                               // 連線失敗
+            trace(flight_event::connected, ec, 0, attempts_);
+            co_await fail_reply(ec);
+            co_return false;
+        }
+
+        auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - attempt_start_);
+        shared_.scoreboard.record_success(ep, rtt);
+        trace(flight_event::connected, 0, rtt.count(), attempts_);
+
+        reply_buf_.fill(0);
+        reply_buf_[1] = kSocksGranted;          // 90
+        co_return !co_await write_reply();      // 連線成功，開始轉送
+    }
+
+    // 等到這個目的地有空位（依到達順序），FIFO 已滿或過了期限就回傳錯誤，由呼叫端回覆 91
+    awaitable<boost::system::error_code> admit(const tcp::endpoint& ep, std::chrono::steady_clock::time_point deadline)
     {
-        reply_buf_[0] = 0;
-        reply_buf_[1] = kSocksRejected;       // 91
+        limit_ = config_.policy_for(ep);
+        if (!limit_.limited())
+            co_return boost::system::error_code{};
 
-        async_write_reply_then(
-            [self = shared_from_this()]
-        {
-          self->close_session();
-        });
+        auto t0 = std::chrono::steady_clock::now();
+        uint32_t seq = 0;
+        auto r = shared_.limiter.enter(limit_, config_.dest_queue_limit, deadline, seq);
+        if (r == dest_limiter::result::granted)
+            co_return boost::system::error_code{};
+        if (r == dest_limiter::result::untracked) {   // 沒有計數：當成不限制，之後不呼叫 connect_done / tunnel_closed
+            limit_ = dest_policy{};
+            co_return boost::system::error_code{};
+        }
+
+        boost::system::error_code ec = make_error_code(boost::system::errc::resource_unavailable_try_again);
+        if (r == dest_limiter::result::queued) {
+            boost::asio::steady_timer timer(io_context_);
+            while (r == dest_limiter::result::queued) {
+                boost::system::error_code _;
+                timer.expires_after(dest_limiter::kPollInterval);
+                co_await timer.async_wait(redirect_error(use_awaitable, _));
+                r = shared_.limiter.poll(limit_, seq, deadline);
+            }
+            ec = (r == dest_limiter::result::granted) ? boost::system::error_code{}
+                                                      : make_error_code(boost::system::errc::timed_out);
+        }
+        auto waited = std::chrono::steady_clock::now() - t0;
+        shared_.limiter.add_wait(waited);
+        trace(flight_event::admission, ec,
+              std::chrono::duration_cast<std::chrono::microseconds>(waited).count());
+        co_return ec;
+    }
+
+    /*
+    ** connect 一個目的地；有設定 egress 位址池時先 bind 來源 IP（port 由 kernel 在 connect 時挑）。
+    ** 某個來源 IP 連到這個目的地的 port 用完（EADDRNOTAVAIL）就換池裡下一個位址再試，
+    ** 全部都試過才回傳錯誤。成功時的來源位址記在 egress_idx_，close_session() 歸還。
+    */
+    awaitable<boost::system::error_code> connect_one(const tcp::endpoint& ep)
+    {
+        using bind_address_no_port = boost::asio::detail::socket_option::boolean<IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>;
+        boost::system::error_code ec;
+        bool use_pool = !shared_.egress.empty() && ep.address().is_v4();
+        uint32_t tried = 0;
+        int retries = 0;
+
+        for (;;) {
+            boost::system::error_code _;
+            remote_socket_.close(_);
+            remote_socket_.open(ep.protocol(), ec);
+            if (ec)
+                co_return ec;
+
+            int src = -1;
+            if (use_pool) {
+                src = shared_.egress.acquire(ep, tried);
+                if (src < 0)                    // 位址池全部試過了
+                    co_return make_error_code(boost::system::errc::address_not_available);
+                if (holding_) {
+                    holding_->egress_dst = ep;
+                    holding_->egress_idx = src;
+                }
+                tried |= 1u << src;
+                remote_socket_.set_option(bind_address_no_port(true), _);
+                remote_socket_.bind(tcp::endpoint(shared_.egress.address(src), 0), ec);
+            }
+
+            if (!ec) {
+                attempt_start_ = std::chrono::steady_clock::now();
+                co_await remote_socket_.async_connect(ep, redirect_error(use_awaitable, ec));
+            }
+            if (src < 0)
+                co_return ec;
+
+            if (!ec) {
+                egress_idx_ = src;
+                egress_dst_ = ep;
+                auto local = remote_socket_.local_endpoint(_);
+                trace(flight_event::egress, retries, ipv4_of(local.address()), local.port());
+                co_return ec;
+            }
+            release_egress(ep, src);
+            if (ec != boost::system::errc::address_not_available)
+                co_return ec;
+            shared_.egress.record_unavailable(src);
+            ++retries;
+        }
+    }
+
+    // 回覆 91 後關閉；失敗原因已經記在 flight recorder（resolved / connected / bind_accepted 事件的 code）
+    awaitable<void> fail_reply(const boost::system::error_code& ec)
+    {
+        reply_buf_.fill(0);
+        reply_buf_[1] = kSocksRejected;         // 91
+        co_await write_reply();
+        close_session(ec);
     }
     
     /*
@@ -170,253 +1366,338 @@ class session : public std::enable_shared_from_this<session>{
     ** 第二次 90：告訴 client 外部主機真的來連上我了，此時通常也會把對端的 IP/Port 回報給 client（回覆的 DSTIP/DSTPORT 填對端資訊）。
     ** 完成第二次 90 後，才開始雙向 relay。
     */
-    void start_bind()
+    awaitable<bool> bind_remote()
     {
-        auto self = shared_from_this();
-    
-        // 1. 建立成員 acceptor_
-        bind_acceptor_ = std::make_unique<tcp::acceptor>(
-            io_context_, tcp::endpoint(tcp::v4(), 0));
-        bind_acceptor_->set_option(boost::asio::socket_base::reuse_address(true));
+        // 1. 建立 acceptor
+        tcp::acceptor acceptor(io_context_, tcp::endpoint(tcp::v4(), 0));
+        acceptor.set_option(boost::asio::socket_base::reuse_address(true));
         
         /* ----------First 90------------ */
         // 取得系統分配的 listen 埠，把它寫進 SOCKS 回覆的第 2–3 byte（DSTPORT，大端序）。
         // 這就是 第一次 90 要回的關鍵資訊：「我在哪個 port 在等」。
-        uint16_t port = bind_acceptor_->local_endpoint().port();
+        uint16_t port = acceptor.local_endpoint().port();
     
         reply_buf_.fill(0);
         reply_buf_[1] = kSocksGranted;
         reply_buf_[2] = static_cast<uint8_t>(port >> 8);
         reply_buf_[3] = static_cast<uint8_t>(port & 0xFF);
         /* ----------First 90------------ */
+        trace(flight_event::bind_listen, 0, port);
+        co_await write_reply();
 
-        async_write_reply_then([self] {
-            // 2. 非同步 accept 等外部主機連上來
-            self->bind_acceptor_->async_accept(self->remote_socket_,
-                [self](const boost::system::error_code& ec) {
-                    if (ec) {
-                        self->fail_bind("accept: " + ec.message());
-                        return;
-                    }
-    
-                    /* ----------Second 90------------ */
-                    auto ep   = self->remote_socket_.remote_endpoint();
-                    uint32_t ip   = ep.address().to_v4().to_uint();   // host-byte-order
-                    uint16_t port = ep.port();
-
-                    self->reply_buf_.fill(0);
-                    self->reply_buf_[1] = kSocksGranted;
-                    self->reply_buf_[2] = port >> 8;
-                    self->reply_buf_[3] = port & 0xFF;
-                    self->reply_buf_[4] = (ip >> 24) & 0xFF;
-                    self->reply_buf_[5] = (ip >> 16) & 0xFF;
-                    self->reply_buf_[6] = (ip >>  8) & 0xFF;
-                    self->reply_buf_[7] =  ip        & 0xFF;
-                    /* ----------Second 90------------ */
-
-                    self->async_write_reply_then([self] {
-                        self->start_relay();             // 開始資料轉發
-                    });
-                });
-        });
-    }
+        // 2. 非同步 accept 等外部主機連上來
+        boost::system::error_code ec;
+        co_await acceptor.async_accept(remote_socket_, redirect_error(use_awaitable, ec));
+        if (ec) {
+            trace(flight_event::bind_accepted, ec);
+            co_await fail_reply(ec);
+            co_return false;
+        }
     
-    void fail_bind(std::string_view reason)
-    {
+        /* ----------Second 90------------ */
+        auto ep = remote_socket_.remote_endpoint(ec);
+        trace(flight_event::bind_accepted, ec, ipv4_of(ep.address()), ep.port());
+        uint32_t ip = ep.address().to_v4().to_uint();   // host-byte-order
+        port        = ep.port();
+
         reply_buf_.fill(0);
-        reply_buf_[1] = kSocksRejected;
-        async_write_reply_then(
-            [self = shared_from_this()] { self->close_session(); });
+        reply_buf_[1] = kSocksGranted;
+        reply_buf_[2] = port >> 8;
+        reply_buf_[3] = port & 0xFF;
+        reply_buf_[4] = (ip >> 24) & 0xFF;
+        reply_buf_[5] = (ip >> 16) & 0xFF;
+        reply_buf_[6] = (ip >>  8) & 0xFF;
+        reply_buf_[7] =  ip        & 0xFF;
+        /* ----------Second 90------------ */
+
+        co_return !co_await write_reply();      // 開始資料轉發
     }
     
-    template<class Fn>
-    void async_write_reply_then(Fn&& next)
+    /*
+    ** 雙向轉送：每個方向一個 reader 與一個 writer coroutine，中間是 relay_queue。
+    ** reader 把資料讀進佇列尾端的 chunk，writer 從前端寫出，兩邊可以同時進行。
+    ** 流量控制：
+    **   - 佇列超過 relay_high_watermark 時 reader 暫停，writer 把它消化到 relay_low_watermark 以下才恢復；
+    **   - 每配置一塊 chunk 都要先向全域 relay_budget 預留，預算用完時 reader 也暫停；
+    **     reader 先 async_wait 到 socket 可讀才預留，佇列寫空時 writer 把 chunk 全部還回，閒置的 tunnel 不占預算；
+    **     最後一塊 chunk 只還預算、記憶體留在佇列裡（idle_tail），小封包的 tunnel 不會每個封包都 new / delete 16 KiB。
+    ** 這樣慢的一端（例如行動網路上的 client）只會讓快的一端停止讀取，記憶體不會無限制成長。
+    ** reader 讀到 EOF / 錯誤時，writer 把剩下的資料寫完才 close_session()；writer 出錯則直接 close_session()。
+    ** 四條 coroutine 都結束後才 return，session 才會被釋放。
+    */
+    awaitable<void> relay()
     {
-        auto self = shared_from_this();
-        boost::asio::async_write(
-            client_socket_, boost::asio::buffer(reply_buf_),
-            [self, next = std::forward<Fn>(next)](auto /*ec*/, auto /*len*/) {
-                next();   // 回覆寫完後執行後續動作
-            });
-    }
-    
-    void start_relay() {           // 啟動雙向轉送
-        read_from_client();
-        read_from_remote();
+        auto spawn = [this](awaitable<void> pump) {
+            ++active_pumps_;
+            boost::asio::co_spawn(io_context_, std::move(pump),
+                [this](std::exception_ptr) {
+                    --active_pumps_;
+                    pumps_done_timer_.cancel();
+                });
+        };
+        // heavy hitter 統計的 key：來源是 client，目的地是 CONNECT 的遠端或 BIND 接進來的對端
+        // sketch 的 key 是 IPv4；任一端不是 IPv4（ipv4_of() 回傳 0）就不統計，免得全部併成一個 0.0.0.0
+        boost::system::error_code ec;
+        traffic_src_ = ipv4_of(client_socket_.remote_endpoint(ec).address());
+        traffic_dst_ = ipv4_of(remote_socket_.remote_endpoint(ec).address());
+        traffic_tracked_ = traffic_src_ != 0 && traffic_dst_ != 0;
+        if (traffic_tracked_)
+            shared_.traffic.add(traffic_src_, traffic_dst_, 0, 1);
+
+        client_socket_.non_blocking(true, ec);   // relay_read 在 wait_read 之後同步 read_some
+        remote_socket_.non_blocking(true, ec);
+        spawn(relay_read(client_socket_, up_));
+        spawn(relay_write(remote_socket_, up_));
+        spawn(relay_read(remote_socket_, down_));
+        spawn(relay_write(client_socket_, down_));
+
+        while (active_pumps_ > 0) {
+            pumps_done_timer_.expires_at(std::chrono::steady_clock::time_point::max());
+            co_await pumps_done_timer_.async_wait(redirect_error(use_awaitable, ec));
+        }
+        release_chunks(up_.budgeted() + down_.budgeted());
+        up_.chunks.clear();
+        down_.chunks.clear();
     }
-    
-    /* client → remote */
-    void read_from_client()
+
+    // 單一方向的轉送佇列：一串 kRelayChunk 大小的 chunk，reader 寫 [len, kRelayChunk)，writer 讀 [off, len)
+    struct relay_queue{
+        struct chunk{
+            std::unique_ptr<uint8_t[]> data{new uint8_t[kRelayChunk]};
+            std::size_t off = 0;
+            std::size_t len = 0;
+        };
+
+        relay_queue(boost::asio::io_context& io_context, uint64_t& bytes, flight_event first_event)
+         : reader_wake(io_context), writer_wake(io_context), bytes(bytes), first_event(first_event) {}
+
+        void wake_all()
+        {
+            reader_wake.cancel();
+            writer_wake.cancel();
+        }
+
+        // 目前占著 relay_budget 的 chunk 數
+        std::size_t budgeted() const { return chunks.size() - (idle_tail ? 1 : 0); }
+
+        std::deque<chunk> chunks;            // push_back / pop_front 不會讓其他 chunk 的 reference 失效
+        bool idle_tail = false;              // 佇列只剩一塊空的 chunk：預算已還，記憶體留著給下一次讀取
+        std::size_t queued = 0;              // 還沒寫出去的 bytes
+        bool reader_done = false;
+        boost::system::error_code read_ec;
+        boost::asio::steady_timer reader_wake;
+        boost::asio::steady_timer writer_wake;
+        uint64_t& bytes;
+        flight_event first_event;
+        uint32_t pauses = 0;
+        std::chrono::nanoseconds paused{0};
+    };
+
+    // 以下幾個向共享資源預留 / 歸還的地方同步更新 holding_，Child 異常結束時 Parent 依此代為歸還
+    bool reserve_chunk()
     {
-        auto self = shared_from_this();
-        client_socket_.async_read_some(
-            boost::asio::buffer(recv_buf_),
-            [self](auto ec, std::size_t n) {
-                if (ec) { self->close_session(); return; }
-                self->write_to_remote(n);
-            });
+        if (!shared_.relay.try_reserve(kRelayChunk))
+            return false;
+        if (holding_)
+            holding_->relay_bytes += kRelayChunk;
+        return true;
     }
-    
-    void write_to_remote(std::size_t n)
+
+    void release_chunks(std::size_t n)
     {
-        auto self = shared_from_this();
-        boost::asio::async_write(
-            remote_socket_, boost::asio::buffer(recv_buf_, n),
-            [self](auto ec, std::size_t) {
-                if (ec) { self->close_session(); return; }
-                self->read_from_client();
-            });
+        shared_.relay.release(n * kRelayChunk);
+        if (holding_)
+            holding_->relay_bytes -= n * kRelayChunk;
     }
-    
-    /* remote → client */
-    void read_from_remote()
+
+    void release_egress(const tcp::endpoint& dst, int idx)
     {
-        auto self = shared_from_this();
-        remote_socket_.async_read_some(
-            boost::asio::buffer(recv_buf_),
-            [self](auto ec, std::size_t n) {
-                if (ec) { self->close_session(); return; }
-                self->write_to_client(n);
-            });
+        shared_.egress.release(dst, idx);
+        if (holding_)
+            holding_->egress_idx = -1;
     }
-    
-    void write_to_client(std::size_t n)
+
+    // 把還沒算進 traffic_sketch 的 bytes 一次加進去
+    void account_traffic()
     {
-        auto self = shared_from_this();
-        boost::asio::async_write(
-            client_socket_, boost::asio::buffer(recv_buf_, n),
-            [self](auto ec, std::size_t) {
-                if (ec) { self->close_session(); return; }
-                self->read_from_remote();
-            });
+        uint64_t total = bytes_up_ + bytes_down_;
+        shared_.traffic.add(traffic_src_, traffic_dst_, total - bytes_accounted_, 0);
+        bytes_accounted_ = total;
     }
 
-    // 判斷 IP 是否符合 pattern, e.g., pattern = "140.113.*.*", ip = "140.113.5.6" 
-    static bool match_ip(const std::string& pattern, const std::string& ip)
+    // 在 timer 上等到被 cancel()（或逾時）為止
+    // 不寫成 coroutine，直接回傳 async_wait 的 awaitable：Asio 每個 thread 只快取一塊 coroutine frame，
+    // 多包一層 frame 的話每次等待都要重新配置。結果用不到，error_code 放在 static 變數
+    static awaitable<void> wait_on(boost::asio::steady_timer& timer,
+                                   std::chrono::steady_clock::time_point until = std::chrono::steady_clock::time_point::max())
     {
-        std::array<std::string, 4> p{}, a{};
-        std::istringstream(pattern) >> p[0];             // 先把整個 pattern 讀進 p[0]
-        // Tips: >> 對 std::string 是以空白當分隔，所以先把 . 換成空白，>> 就能一次讀四段。
-        std::replace(p[0].begin(), p[0].end(), '.', ' ');
-        std::istringstream(p[0]) >> p[0] >> p[1] >> p[2] >> p[3];
-
-        std::istringstream(ip) >> a[0];
-        std::replace(a[0].begin(), a[0].end(), '.', ' ');
-        std::istringstream(a[0]) >> a[0] >> a[1] >> a[2] >> a[3];
-
-        for (size_t i = 0; i < 4; ++i)
-            if (p[i] != "*" && p[i] != a[i])
-                return false;
-        return true;
+        static boost::system::error_code ignored;
+        timer.expires_at(until);
+        return timer.async_wait(redirect_error(use_awaitable, ignored));
     }
 
-    void apply_firewall()
+    awaitable<void> relay_read(tcp::socket& from, relay_queue& q)
     {
-        if (request_.Reply != "Firewall")
-            return;
+        boost::system::error_code ec;
+        while (!closed_) {
+            // 1. 水位：超過 high 就暫停，直到 writer 降到 low 以下
+            if (q.queued >= config_.relay_high_watermark) {
+                auto t0 = std::chrono::steady_clock::now();
+                while (!closed_ && q.queued > config_.relay_low_watermark)
+                    co_await wait_on(q.reader_wake);
+                auto paused = std::chrono::steady_clock::now() - t0;
+                ++q.pauses;
+                q.paused += paused;
+                shared_.relay.add_backpressure(true, paused);
+                continue;
+            }
 
-        request_.Reply = "Reject";
+            // 2. 先等到有資料可讀才佔用記憶體：閒置的 tunnel 不持有任何 chunk，也不占預算
+            co_await from.async_wait(tcp::socket::wait_read, redirect_error(use_awaitable, ec));
+            if (ec || closed_)
+                break;
 
-        std::ifstream conf("client_socks.conf");
-        if (!conf) return;                  // 檔案不存在即全部拒絕
+            // 3. 尾端 chunk 滿了（或佇列是空的、只剩閒置的 chunk）就向全域預算預留一塊
+            if (q.chunks.empty() || q.idle_tail || q.chunks.back().len == kRelayChunk) {
+                if (!reserve_chunk()) {
+                    // 其他 Child Process 釋放預算時無法通知這裡，定期重試；自己的 writer 釋放時會提早叫醒
+                    auto t0 = std::chrono::steady_clock::now();
+                    while (!closed_ && !reserve_chunk())
+                        co_await wait_on(q.reader_wake, std::chrono::steady_clock::now() + std::chrono::milliseconds(5));
+                    auto paused = std::chrono::steady_clock::now() - t0;
+                    ++q.pauses;
+                    q.paused += paused;
+                    shared_.relay.add_backpressure(false, paused);
+                    if (closed_)          // 沒有預留到就被關閉
+                        break;
+                }
+                if (q.idle_tail)          // 重用閒置的那塊，不用重新配置
+                    q.idle_tail = false;
+                else
+                    q.chunks.emplace_back();
+            }
 
-        std::string verb, type, pattern;
-        while (conf >> verb >> type >> pattern) // e.g., permit c 140.113.*.*
-        {
-            if (verb != "permit")
+            // 4. 同步（non-blocking）讀進尾端 chunk 的剩餘空間；reader 不會帶著 chunk 的參考暫停，
+            //    所以 writer 寫空佇列時可以把所有 chunk 都還回預算
+            auto& tail = q.chunks.back();
+            std::size_t n = from.read_some(
+                boost::asio::buffer(tail.data.get() + tail.len, kRelayChunk - tail.len), ec);
+            if (ec == boost::asio::error::would_block) {   // 假的可讀通知：剛預留的空 chunk 還回去
+                if (tail.len == 0) {
+                    if (q.chunks.size() == 1)
+                        q.idle_tail = true;
+                    else
+                        q.chunks.pop_back();
+                    release_chunks(1);
+                }
+                ec = {};
                 continue;
+            }
+            if (ec)
+                break;
+            if (q.bytes == 0)
+                trace(q.first_event, 0, n);
+            q.bytes  += n;
+            tail.len += n;
+            q.queued += n;
+            q.writer_wake.cancel();
+            if (traffic_tracked_ && bytes_up_ + bytes_down_ - bytes_accounted_ >= kTrafficFlushBytes)
+                account_traffic();
+        }
+        q.reader_done = true;
+        q.read_ec     = ec;
+        q.writer_wake.cancel();
+    }
 
-            if ((type == "c" && request_.CD != 1) ||      // 動作不符
-                (type == "b" && request_.CD != 2))
-                continue;
+    awaitable<void> relay_write(tcp::socket& to, relay_queue& q)
+    {
+        boost::system::error_code ec;
+        for (;;) {
+            while (!closed_ && q.queued == 0 && !q.reader_done)
+                co_await wait_on(q.writer_wake);
+            if (closed_)
+                co_return;
+            if (q.queued == 0) {                 // reader 已結束，而且都寫完了
+                ec = q.read_ec;
+                break;
+            }
+
+            // 前面已經寫完的 chunk（不是尾端）先釋放
+            while (q.chunks.front().off == q.chunks.front().len && q.chunks.size() > 1) {
+                q.chunks.pop_front();
+                release_chunks(1);
+            }
 
-            if (match_ip(pattern, request_.D_IP)) {      // IP 符合
-                request_.Reply = "Accept";
-                return;                                   // 第一條符合即通過
+            auto& front = q.chunks.front();
+            std::size_t n = co_await boost::asio::async_write(
+                to, boost::asio::buffer(front.data.get() + front.off, front.len - front.off),
+                redirect_error(use_awaitable, ec));
+            if (ec)
+                break;
+            front.off += n;
+            q.queued  -= n;
+            // 寫完的 chunk 還回預算；佇列寫空時連尾端那塊也還（記憶體留著），預算只算真正排隊中的資料
+            if (front.off == front.len && q.chunks.size() > 1) {
+                q.chunks.pop_front();
+                release_chunks(1);
             }
+            else if (q.queued == 0) {
+                front.off = front.len = 0;
+                q.idle_tail = true;
+                release_chunks(1);
+            }
+            if (q.queued <= config_.relay_low_watermark)
+                q.reader_wake.cancel();
         }
+        close_session(ec);
     }
-    
-    // 將字串依指定分隔字元切成多段，忽略空段與 \r
-    static std::vector<std::string> split_tokens(std::string_view src, char delim)
-    {
-        std::vector<std::string> out;
-        std::string token;
-        std::istringstream iss{std::string(src)};   // 轉成 stream 方便 getline
-        while (std::getline(iss, token, delim)) {
-            if (!token.empty() && token.back() == '\r')
-                token.pop_back();
-            if (!token.empty())
-                out.push_back(std::move(token));
+
+    // 規則由 server 在 fork 之前編譯好（見 firewall.hpp），判斷邏輯在 evaluate_firewall()
+    awaitable<void> apply_firewall()
+    {
+        if (request_.Reply != "Firewall")
+            co_return;
+
+        request_.Reply = "Reject";
+
+        switch (evaluate_firewall(rules_, request_)) {
+            case fw_decision::accept:
+                request_.Reply = "Accept";               // SOCKS4a 之後 connect_to_remote() 再解析
+                co_return;
+            case fw_decision::reject:
+                co_return;
+            case fw_decision::resolve:
+                break;
         }
-        return out;
+
+        // 把DOMAIN NAME做DNS解析，只留下 IP 規則允許的位址
+        boost::system::error_code ec;
+        auto results = co_await resolver_.async_resolve(
+            request_.Domain, request_.D_PORT, redirect_error(use_awaitable, ec));
+        trace(flight_event::resolved, ec, results.size());
+        if (ec)                                           // DNS 失敗
+            co_return;
+        for (const auto& r : results)
+            if (rules_.permits_ip(r.endpoint().address().to_string(), request_.CD))
+                resolved_.push_back(r.endpoint());
+        if (resolved_.empty())
+            co_return;
+
+        request_.D_IP  = resolved_.front().address().to_string();
+        request_.Reply = "Accept";
     }
     
     void parse_request(std::size_t length)
     {
-        request_.Reply = "Firewall";                    // Init
         std::fill(reply_buf_.begin() + 2, reply_buf_.end(), 0); // 清零 2~7 bytes(port and IP)
-    
-        // SOCKS4_REQUEST 至少要有 9 byte：VN, CD, PORT(2), IP(4), \0（USERID）
-        if (length < 9) { 
-            request_.Reply = "Reject";
-            return;
-        }
-    
-        request_.VN = recv_buf_[0];
-        if (request_.VN != 4) {                         // 非 SOCKS4 直接拒絕
-            request_.Reply = "Reject";
+        if (!parse_socks4_request(recv_buf_.data(), length, request_))
             return;
-        }
-    
-        request_.CD  = recv_buf_[1];
-        request_.Command = (request_.CD == 1) ? "CONNECT" : "BIND"; // CD, 1 for CONNECT, 2 for BIND
-        
-        // DSTPORT, 2 bytes, Big-endian，轉換成字串
-        uint16_t dst_port = static_cast<uint16_t>((recv_buf_[2] << 8) | recv_buf_[3]);
-        request_.D_PORT  = std::to_string(dst_port);
-    
-        // DSTIP, 4 bytes
-        // SOCKS4a，前 3 bytes 是 0，最後一byte 非 0
-        bool domain_mode = (recv_buf_[4] == 0 && recv_buf_[5] == 0 &&
-                            recv_buf_[6] == 0 && recv_buf_[7] != 0);
-    
-        if (domain_mode) {                              // SOCKS4a
-            std::size_t idx = 8;
-            while (idx < length && recv_buf_[idx] != 0) ++idx; // USERID 是一串以 \0 結尾的字串，一路跳到USERID的結尾
-            ++idx;                                                  // 指到 domain 首字元
-    
-            std::string domain;
-            while (idx < length && recv_buf_[idx] != 0)
-                domain.push_back(recv_buf_[idx++]);       // 把 domain 字串 一直讀到 NUL 結尾為止。
-    
-            if (domain.empty()) {                       // domain 解析失敗
-                request_.Reply = "Reject";
-                return;
-            }
-    
-            // 把DOMAIN NAME做DNS解析
-            // 成功就存到 request_.D_IP，失敗就 Reject
-            boost::asio::ip::tcp::resolver resolver(io_context_);
-            boost::system::error_code ec;
-            auto results = resolver.resolve(domain, request_.D_PORT, ec);
-            if (ec) {                                   // DNS 失敗
-                request_.Reply = "Reject";
-                return;
-            }
-            request_.D_IP = results->endpoint().address().to_string();
-        }
-
-        else {                                          // 一般 IPv4
-            request_.D_IP = std::to_string(recv_buf_[4]) + '.' +
-                             std::to_string(recv_buf_[5]) + '.' +
-                             std::to_string(recv_buf_[6]) + '.' +
-                             std::to_string(recv_buf_[7]);
-        }
     
         /* ---------- 來源端資訊 ---------- */
-        request_.S_IP   = client_socket_.remote_endpoint().address().to_string();
-        request_.S_PORT = std::to_string(client_socket_.remote_endpoint().port());
+        boost::system::error_code ec;
+        auto peer = client_socket_.remote_endpoint(ec);
+        request_.S_IP   = peer.address().to_string();
+        request_.S_PORT = std::to_string(peer.port());
     }
 
     std::array<uint8_t, 8> reply_buf_;
@@ -425,17 +1706,44 @@ class session : public std::enable_shared_from_this<session>{
     tcp::resolver resolver_;
     boost::asio::io_context& io_context_;
     struct socks4Msg request_;
-    std::array<uint8_t, kBufSize> recv_buf_;
-    std::unique_ptr<tcp::acceptor> bind_acceptor_;
+    std::array<uint8_t, kBufSize> recv_buf_;       // 握手用
+    shared_state& shared_;
+    const firewall_rules& rules_;
+    const server_config& config_;
+    std::vector<tcp::endpoint> resolved_;
+    std::vector<tcp::endpoint> candidates_;
+    tcp::endpoint egress_dst_;
+    int egress_idx_ = -1;                          // 這條連線用的 egress 位址池索引，-1 = 沒有 bind
+    child_holdings::slot* holding_;                // 這個 Child 在 shared_.holdings 的格子，nullptr = 不追蹤
+    dest_policy limit_;                            // 目前 connect 的目的地適用的並行上限
+    bool tunnel_held_ = false;                     // 是否佔了 limit_ 的一個 tunnel 名額
+    uint32_t traffic_src_ = 0;
+    uint32_t traffic_dst_ = 0;
+    uint64_t bytes_accounted_ = 0;                 // 已經加進 traffic_sketch 的 bytes
+    bool traffic_tracked_ = false;                 // 兩端都是 IPv4 才計入 traffic_sketch
+    std::chrono::steady_clock::time_point attempt_start_;
+    uint32_t session_id_;
+    uint32_t attempts_ = 0;
+    uint64_t bytes_up_ = 0;
+    uint64_t bytes_down_ = 0;
+    bool closed_ = false;
+    relay_queue up_;                               // client → remote
+    relay_queue down_;                             // remote → client
+    boost::asio::steady_timer pumps_done_timer_;   // 每條 pump 結束時 cancel，relay() 用來等待
+    int active_pumps_ = 0;
 };
 
 class server{
   public:
-    server(boost::asio::io_context& io_context, unsigned short port)
-     : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), io_context_(io_context), sigchld_(io_context, SIGCHLD)
+    server(boost::asio::io_context& io_context, unsigned short port, shared_state& shared, const server_config& config)
+     : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), io_context_(io_context), sigchld_(io_context, SIGCHLD), sigusr1_(io_context, SIGUSR1), shared_(shared), config_(config)
     {
       acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
+      // TCP Fast Open：client 帶著 cookie 時 SOCKS4 request 跟著 SYN 一起到（需要 net.ipv4.tcp_fastopen 開啟 server 端）
+      boost::system::error_code ec;
+      acceptor_.set_option(boost::asio::detail::socket_option::integer<IPPROTO_TCP, TCP_FASTOPEN>(kFastOpenQueue), ec);
       wait_child();
+      wait_dump();
       start_accept();
     }
 
@@ -446,20 +1754,64 @@ class server{
       sigchld_.async_wait(
         [this](boost::system::error_code ec, int signo)
         {
+          if (ec == boost::asio::error::operation_aborted)   // Child 裡 cancel() 之後不要再等
+            return;
           int status;
-          while (waitpid(-1, &status, WNOHANG) > 0);
+          pid_t pid;
+          while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            shared_.reclaim(pid);      // 被 SIGKILL / crash 的 Child 沒歸還的共享資源
           wait_child();
         });
     }
     
+    // 熱更新：client_socks.conf 的 mtime 變了才重新編譯，Child 透過 fork 直接繼承編譯好的規則
+    void reload_firewall()
+    {
+      struct stat st{};
+      if (stat(kFirewallConf, &st) != 0)
+        st.st_mtim = {};                 // 檔案不存在 -> 空規則，全部拒絕
+      if (st.st_mtim.tv_sec == conf_mtime_.tv_sec && st.st_mtim.tv_nsec == conf_mtime_.tv_nsec &&
+          rules_loaded_)
+        return;
+      rules_.load(kFirewallConf);
+      conf_mtime_   = st.st_mtim;
+      rules_loaded_ = true;
+    }
+
+    // kill -USR1 <pid>：把 flight recorder 倒到 kFlightDumpFile
+    void wait_dump()
+    {
+      sigusr1_.async_wait(
+        [this](boost::system::error_code ec, int signo)
+        {
+          if (ec)
+            return;
+          std::ofstream out(kFlightDumpFile, std::ios::trunc);
+          shared_.relay.report(out);
+          shared_.egress.report(out);
+          shared_.limiter.report(out);
+          shared_.traffic.report(out);
+          shared_.holdings.report(out);
+          shared_.recorder.dump(out);
+          wait_dump();
+        });
+    }
+
     void start_accept()
     {
       // async_accept 等 client 連線
       acceptor_.async_accept(
         [this](boost::system::error_code ec, tcp::socket socket)
         {
+          // Child 關掉 acceptor_ 後，這個 handler 會以 operation_aborted 回來；
+          // 不能再呼叫 start_accept()，否則對已關閉的 acceptor 無限重試，Child 永遠不會結束
+          if (!acceptor_.is_open())
+            return;
+
           if (!ec)
           {
+            reload_firewall();
+
             // notify_fork 在 fork() 之前呼叫，告知 Boost.Asio 做好準備，如釋放內部的 epoll/kqueue 等資源。
             io_context_.notify_fork(boost::asio::io_context::fork_prepare);
 
@@ -476,8 +1828,11 @@ class server{
               io_context_.notify_fork(boost::asio::io_context::fork_child);
               acceptor_.close();
               sigchld_.cancel();
-              // 每開一個子行程就建立一個 session 物件，並開始處理請求。
-              std::make_shared<session>(std::move(socket), io_context_)->start();
+              sigusr1_.cancel();
+              // 每開一個子行程就建立一個 session coroutine，並開始處理請求。
+              boost::asio::co_spawn(io_context_,
+                session::serve(std::make_unique<session>(std::move(socket), io_context_, shared_, rules_, config_)),
+                boost::asio::detached);
             }
 
             else if (pid > 0)
@@ -498,6 +1853,12 @@ class server{
     tcp::acceptor acceptor_;
     boost::asio::io_context& io_context_;
     boost::asio::signal_set sigchld_;
+    boost::asio::signal_set sigusr1_;
+    shared_state& shared_;
+    const server_config& config_;
+    firewall_rules rules_;
+    struct timespec conf_mtime_{};
+    bool rules_loaded_ = false;
 };
 
 int main(int argc, char* argv[])
@@ -509,8 +1870,13 @@ int main(int argc, char* argv[])
       std::cerr << "Usage: ./socks_server <port>\n";
       return 1;
     }
+    server_config config;
+    config.load(kServerConf);
     boost::asio::io_context io_context;
-    server s(io_context, std::atoi(argv[1]));
+    shared_state* shared = map_shared<shared_state>();   // fork 之前配置，Child 繼承同一塊
+    shared->relay.set_limit(config.relay_memory_budget);
+    shared->egress.configure(config.egress, config.egress_least_used);
+    server s(io_context, std::atoi(argv[1]), *shared, config);
     io_context.run();
   }
   catch (std::exception& e)